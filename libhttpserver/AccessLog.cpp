@@ -0,0 +1,288 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+
+#include "AccessLog.h"
+
+// Single producer (the owning session thread), single consumer (the writer)
+struct AccessRing
+{
+    static const std::size_t capacity = 256;
+
+    std::array<AccessRecord, capacity> records;
+    alignas(64) std::atomic<std::size_t> head{0};
+    alignas(64) std::atomic<std::size_t> tail{0};
+    std::atomic<std::uint64_t> dropped{0};
+    std::atomic<bool> retired{false};
+};
+
+namespace
+{
+    const std::chrono::milliseconds flush_interval{10};
+
+    std::atomic<std::uint64_t> next_log_id{1};
+
+    // Rings this thread writes to, one per log; released to the writer when the thread exits
+    struct LocalRings
+    {
+        std::vector<std::pair<std::uint64_t, std::shared_ptr<AccessRing>>> rings;
+
+        ~LocalRings()
+        {
+            for (auto& it : rings)
+            {
+                it.second->retired.store(true, std::memory_order_release);
+            }
+        }
+    };
+
+    thread_local LocalRings local_rings;
+
+    template<std::size_t N>
+    void copy_text(char (&destination)[N], boost::beast::string_view text)
+    {
+        std::size_t length = std::min(text.size(), N - 1);
+        std::memcpy(destination, text.data(), length);
+        destination[length] = '\0';
+    }
+
+    void append_json(std::string& out, const char* text)
+    {
+        out.push_back('"');
+        for (const char* it = text; *it; ++it)
+        {
+            unsigned char c = static_cast<unsigned char>(*it);
+            if (c == '"' || c == '\\')
+            {
+                out.push_back('\\');
+                out.push_back(*it);
+            }
+            else if (c < 0x20)
+            {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out.append(escaped);
+            }
+            else
+                out.push_back(*it);
+        }
+        out.push_back('"');
+    }
+
+    void format(const AccessRecord& record, std::string& out)
+    {
+        std::time_t seconds = static_cast<std::time_t>(record.timestamp / 1000000);
+        std::tm utc{};
+        gmtime_r(&seconds, &utc);
+
+        char field[96];
+        std::snprintf(field, sizeof(field), "{\"time\":\"%04d-%02d-%02dT%02d:%02d:%02d.%06dZ\",\"peer\":",
+                      utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday, utc.tm_hour, utc.tm_min, utc.tm_sec,
+                      static_cast<int>(record.timestamp % 1000000));
+        out.append(field);
+        append_json(out, record.peer);
+
+        if (record.status == 0)
+        {
+            out.append(",\"error\":");
+            append_json(out, record.text);
+            out.append("}\n");
+            return;
+        }
+
+        out.append(",\"method\":");
+        append_json(out, record.method);
+        out.append(",\"path\":");
+        append_json(out, record.text);
+        std::snprintf(field, sizeof(field), ",\"status\":%u,\"bytes_in\":%llu,\"bytes_out\":%llu",
+                      static_cast<unsigned>(record.status), static_cast<unsigned long long>(record.bytes_in),
+                      static_cast<unsigned long long>(record.bytes_out));
+        out.append(field);
+        std::snprintf(field, sizeof(field), ",\"read_us\":%u,\"total_us\":%u}\n",
+                      static_cast<unsigned>(record.read_us), static_cast<unsigned>(record.total_us));
+        out.append(field);
+    }
+
+    std::int64_t now()
+    {
+        auto since_epoch = std::chrono::system_clock::now().time_since_epoch();
+        return std::chrono::duration_cast<std::chrono::microseconds>(since_epoch).count();
+    }
+}
+
+AccessLog::AccessLog(const std::string& path)
+    : id(next_log_id.fetch_add(1)), output(stdout), owned(false), running(true), retired_drops(0), reported_drops(0)
+{
+    if (!path.empty())
+    {
+        output = std::fopen(path.c_str(), "a");
+        owned = output != nullptr;
+        if (owned)
+        {
+            // Every batch becomes one append, so prefork workers sharing the file never split a line
+            std::setvbuf(output, nullptr, _IONBF, 0);
+        }
+        else
+        {
+            std::cerr << "Error: could not open access log " << path << ", logging to stdout." << std::endl;
+            output = stdout;
+        }
+    }
+
+    writer = std::thread(&AccessLog::write_loop, this);
+}
+
+AccessLog::~AccessLog()
+{
+    running.store(false);
+    writer.join();
+
+    if (owned)
+        std::fclose(output);
+}
+
+AccessRing& AccessLog::local_ring()
+{
+    for (auto& it : local_rings.rings)
+    {
+        if (it.first == id)
+            return *it.second;
+    }
+
+    auto ring = std::make_shared<AccessRing>();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        rings.push_back(ring);
+    }
+    local_rings.rings.emplace_back(id, ring);
+    return *ring;
+}
+
+void AccessLog::push(const AccessRecord& record)
+{
+    AccessRing& ring = local_ring();
+
+    std::size_t tail = ring.tail.load(std::memory_order_relaxed);
+    if (tail - ring.head.load(std::memory_order_acquire) == AccessRing::capacity)
+    {
+        ring.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    ring.records[tail % AccessRing::capacity] = record;
+    ring.tail.store(tail + 1, std::memory_order_release);
+}
+
+void AccessLog::access(const std::string& peer, boost::beast::string_view method, const std::string& path,
+                       unsigned status, std::uint64_t bytes_in, std::uint64_t bytes_out,
+                       std::uint32_t read_us, std::uint32_t total_us)
+{
+    AccessRecord record;
+    record.timestamp = now();
+    record.bytes_in = bytes_in;
+    record.bytes_out = bytes_out;
+    record.read_us = read_us;
+    record.total_us = total_us;
+    record.status = static_cast<std::uint16_t>(status);
+    copy_text(record.method, method);
+    copy_text(record.peer, peer);
+    copy_text(record.text, path);
+    push(record);
+}
+
+void AccessLog::error(const std::string& peer, const char* what, const std::string& message)
+{
+    AccessRecord record;
+    record.timestamp = now();
+    record.bytes_in = 0;
+    record.bytes_out = 0;
+    record.read_us = 0;
+    record.total_us = 0;
+    record.status = 0;
+    copy_text(record.method, "");
+    copy_text(record.peer, peer);
+    copy_text(record.text, std::string(what) + ": " + message);
+    push(record);
+}
+
+std::uint32_t elapsed_us(std::chrono::steady_clock::time_point since)
+{
+    auto elapsed = std::chrono::steady_clock::now() - since;
+    return static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+}
+
+std::uint64_t AccessLog::dropped()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::uint64_t total = retired_drops;
+    for (const auto& ring : rings)
+    {
+        total += ring->dropped.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+bool AccessLog::drain(std::string& batch)
+{
+    std::vector<std::shared_ptr<AccessRing>> snapshot;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        snapshot = rings;
+    }
+
+    for (const auto& ring : snapshot)
+    {
+        std::size_t head = ring->head.load(std::memory_order_relaxed);
+        std::size_t tail = ring->tail.load(std::memory_order_acquire);
+        for (; head != tail; ++head)
+        {
+            format(ring->records[head % AccessRing::capacity], batch);
+        }
+        ring->head.store(tail, std::memory_order_release);
+    }
+
+    {
+        // Forget rings whose thread has exited once they are empty
+        std::lock_guard<std::mutex> lock(mutex);
+        rings.erase(std::remove_if(rings.begin(), rings.end(), [this](const std::shared_ptr<AccessRing>& ring)
+        {
+            bool finished = ring->retired.load(std::memory_order_acquire) &&
+                            ring->head.load(std::memory_order_relaxed) == ring->tail.load(std::memory_order_acquire);
+            if (finished)
+                retired_drops += ring->dropped.load(std::memory_order_relaxed);
+            return finished;
+        }), rings.end());
+    }
+
+    std::uint64_t total = dropped();
+    if (total != reported_drops)
+    {
+        batch.append("{\"dropped\":").append(std::to_string(total)).append("}\n");
+        reported_drops = total;
+    }
+
+    return !batch.empty();
+}
+
+void AccessLog::write_loop()
+{
+    std::string batch;
+
+    for (bool last = false; !last;)
+    {
+        last = !running.load();
+
+        batch.clear();
+        if (drain(batch))
+        {
+            std::fwrite(batch.data(), 1, batch.size(), output);
+            std::fflush(output);
+        }
+
+        if (!last)
+            std::this_thread::sleep_for(flush_interval);
+    }
+}
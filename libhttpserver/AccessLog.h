@@ -0,0 +1,70 @@
+#ifndef FLEET_ACCESSLOG_H
+#define FLEET_ACCESSLOG_H
+
+#include <boost/beast/core/string.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// One log entry, fixed in size so rings are allocated once and never grow.
+struct AccessRecord
+{
+    std::int64_t timestamp;         // microseconds since the Unix epoch
+    std::uint64_t bytes_in;
+    std::uint64_t bytes_out;
+    std::uint32_t read_us;          // from the end of the header until the body was read
+    std::uint32_t total_us;         // from the end of the header until the response was sent
+    std::uint16_t status;           // 0 marks an error record
+    char method[8];
+    char peer[46];
+    char text[160];                 // request path, or the error description
+};
+
+struct AccessRing;
+
+/*
+ * Access and error log written by a background thread. Session threads push
+ * records into rings of their own without locking; the writer drains every
+ * ring in batches, formats one JSON object per line and writes each batch
+ * with a single call. When a ring is full the record is counted as dropped
+ * rather than making the session wait on a slow disk.
+ */
+class AccessLog
+{
+private:
+    std::uint64_t id;
+    std::FILE* output;
+    bool owned;
+    std::mutex mutex;
+    std::vector<std::shared_ptr<AccessRing>> rings;
+    std::atomic<bool> running;
+    std::uint64_t retired_drops, reported_drops;
+    std::thread writer;
+
+    AccessRing& local_ring();
+    void push(const AccessRecord& record);
+    bool drain(std::string& batch);
+    void write_loop();
+public:
+    explicit AccessLog(const std::string& path = "");
+    ~AccessLog();
+    AccessLog(const AccessLog&) = delete;
+    AccessLog& operator=(const AccessLog&) = delete;
+
+    void access(const std::string& peer, boost::beast::string_view method, const std::string& path, unsigned status,
+                std::uint64_t bytes_in, std::uint64_t bytes_out, std::uint32_t read_us, std::uint32_t total_us);
+    void error(const std::string& peer, const char* what, const std::string& message);
+    std::uint64_t dropped();
+};
+
+// Microseconds since `since`, as recorded in read_us and total_us
+std::uint32_t elapsed_us(std::chrono::steady_clock::time_point since);
+
+#endif //FLEET_ACCESSLOG_H
@@ -0,0 +1,440 @@
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/write.hpp>
+
+#include "Http2Session.h"
+
+namespace beast = boost::beast;         // from <boost/beast.hpp>
+namespace http = beast::http;           // from <boost/beast/http.hpp>
+namespace net = boost::asio;            // from <boost/asio.hpp>
+
+namespace
+{
+    const std::uint32_t max_concurrent_streams = 256;
+    const std::uint32_t stream_window_size = 1 << 20;
+    const std::int32_t connection_window_size = 16 << 20;
+
+    /*
+     * nghttp2 1.60 deprecated its ssize_t based calls in favour of nghttp2_ssize
+     * ones, and select_next_protocol in favour of select_alpn. These wrappers use
+     * whichever the installed version provides.
+     */
+    Http2Session::length_type pending_output(nghttp2_session* session, const std::uint8_t** data)
+    {
+#if NGHTTP2_VERSION_NUM >= 0x013c00
+        return nghttp2_session_mem_send2(session, data);
+#else
+        return nghttp2_session_mem_send(session, data);
+#endif
+    }
+
+    Http2Session::length_type consume_input(nghttp2_session* session, const std::uint8_t* data, std::size_t length)
+    {
+#if NGHTTP2_VERSION_NUM >= 0x013c00
+        return nghttp2_session_mem_recv2(session, data, length);
+#else
+        return nghttp2_session_mem_recv(session, data, length);
+#endif
+    }
+
+    template<class ReadCallback>
+    int submit_response(nghttp2_session* session, std::int32_t id, const std::vector<nghttp2_nv>& nva, ReadCallback read_callback)
+    {
+#if NGHTTP2_VERSION_NUM >= 0x013c00
+        nghttp2_data_provider2 provider;
+        provider.source.ptr = nullptr;
+        provider.read_callback = read_callback;
+        return nghttp2_submit_response2(session, id, nva.data(), nva.size(), read_callback ? &provider : nullptr);
+#else
+        nghttp2_data_provider provider;
+        provider.source.ptr = nullptr;
+        provider.read_callback = read_callback;
+        return nghttp2_submit_response(session, id, nva.data(), nva.size(), read_callback ? &provider : nullptr);
+#endif
+    }
+
+    std::string lowercase(std::string text)
+    {
+        std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return std::tolower(c); });
+        return text;
+    }
+
+    // Headers with no meaning in HTTP/2 (RFC 7540, 8.1.2.2), plus the length we set ourselves
+    bool connection_specific(const std::string& name)
+    {
+        return name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+               name == "transfer-encoding" || name == "upgrade" || name == "content-length";
+    }
+}
+
+Http2Session::Http2Session(beast::ssl_stream<net::ip::tcp::socket&>& stream, net::io_context& ioc, net::thread_pool& pool,
+                           RequestRouter& router, std::uint64_t body_limit, std::string remote_address,
+                           AccessLog* access_log, WorkerSlot* counters)
+    : stream(stream), ioc(ioc), pool(pool), router(router), body_limit(body_limit), remote_address(std::move(remote_address)),
+      access_log(access_log), counters(counters), session(nullptr), reading(false), writing(false)
+{
+    nghttp2_session_callbacks* callbacks;
+    nghttp2_session_callbacks_new(&callbacks);
+    nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, on_begin_headers);
+    nghttp2_session_callbacks_set_on_header_callback(callbacks, on_header);
+    nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, on_data_chunk);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, on_frame_recv);
+    nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, on_stream_close);
+    nghttp2_session_server_new(&session, callbacks, this);
+    nghttp2_session_callbacks_del(callbacks);
+}
+
+Http2Session::~Http2Session()
+{
+    nghttp2_session_del(session);
+}
+
+void Http2Session::run(beast::error_code& ec)
+{
+    nghttp2_settings_entry settings[] = {
+            {NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, max_concurrent_streams},
+            {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, stream_window_size}
+    };
+    nghttp2_submit_settings(session, NGHTTP2_FLAG_NONE, settings, sizeof(settings) / sizeof(settings[0]));
+    nghttp2_session_set_local_window_size(session, NGHTTP2_FLAG_NONE, 0, connection_window_size);
+
+    flush();
+    read();
+
+    // Returns once the connection is done and every dispatched stream has come back
+    ioc.restart();
+    ioc.run();
+
+    ec = failure;
+}
+
+void Http2Session::read()
+{
+    if (reading || failure || !nghttp2_session_want_read(session))
+        return;
+
+    reading = true;
+    stream.async_read_some(net::buffer(incoming), [this](beast::error_code ec, std::size_t length)
+    {
+        reading = false;
+        if(ec)
+            return fail(ec);
+
+        // Complete requests are dispatched from the callbacks while the input is consumed
+        if (consume_input(session, incoming.data(), length) < 0)
+            return fail(beast::errc::make_error_code(beast::errc::protocol_error));
+
+        flush();
+        read();
+    });
+}
+
+void Http2Session::flush()
+{
+    if (writing || failure)
+        return;
+
+    // Gather every frame nghttp2 has queued and hand them to TLS in one write
+    outgoing.clear();
+    for(;;)
+    {
+        const std::uint8_t* data;
+        length_type length = pending_output(session, &data);
+        if (length < 0)
+            return fail(beast::errc::make_error_code(beast::errc::protocol_error));
+        if (length == 0)
+            break;
+
+        outgoing.append(reinterpret_cast<const char*>(data), length);
+    }
+
+    if (outgoing.empty())
+        return;
+
+    writing = true;
+    net::async_write(stream, net::buffer(outgoing), [this](beast::error_code ec, std::size_t)
+    {
+        writing = false;
+        if(ec)
+            return fail(ec);
+
+        flush();
+        read();
+    });
+}
+
+void Http2Session::fail(beast::error_code ec)
+{
+    if (failure)
+        return;
+
+    // Abandons the outstanding read or write; dispatched streams still return, and are dropped
+    failure = ec;
+    beast::error_code ignored;
+    stream.next_layer().cancel(ignored);
+}
+
+void Http2Session::admit(std::int32_t id, Stream& request)
+{
+    HTTPMessage rejection;
+
+    request.limit = router.body_limit(request.path);
+    if (request.limit == 0)
+        request.limit = body_limit;
+
+    if (request.unsupported)
+    {
+        rejection.status = http::status::not_implemented;
+        return reject(id, request, rejection);
+    }
+
+    if (!router.admit(request.path, request.request, rejection))
+        return reject(id, request, rejection);
+
+    auto length = request.request.header.find("Content-Length");
+    if (length != request.request.header.end() && std::strtoull(length->second.c_str(), nullptr, 10) > request.limit)
+    {
+        rejection.status = http::status::payload_too_large;
+        return reject(id, request, rejection);
+    }
+}
+
+void Http2Session::reject(std::int32_t id, Stream& request, HTTPMessage& rejection)
+{
+    request.rejected = true;
+    respond(id, request, rejection);
+}
+
+void Http2Session::respond(std::int32_t id, Stream& request, const HTTPMessage& reply)
+{
+    std::vector<std::pair<std::string, std::string>> fields;
+    fields.emplace_back(":status", std::to_string(static_cast<unsigned>(reply.status)));
+    for (const auto& it : reply.header)
+    {
+        std::string name = lowercase(it.first);
+        if (!connection_specific(name))
+            fields.emplace_back(std::move(name), it.second);
+    }
+    fields.emplace_back("content-length", std::to_string(reply.body.size()));
+
+    std::vector<nghttp2_nv> nva;
+    for (auto& it : fields)
+    {
+        nva.push_back({reinterpret_cast<std::uint8_t*>(&it.first[0]), reinterpret_cast<std::uint8_t*>(&it.second[0]),
+                       it.first.size(), it.second.size(), NGHTTP2_NV_FLAG_NONE});
+    }
+
+    request.answered = true;
+
+    if (counters)
+        counters->requests++;
+
+    if (access_log)
+    {
+        access_log->access(remote_address, request.method, request.path, static_cast<unsigned>(reply.status),
+                           request.bytes_in, reply.body.size(), request.read_us, elapsed_us(request.started));
+    }
+
+    if (reply.body.empty() || request.request.type == RequestType::HEAD)
+    {
+        submit_response(session, id, nva, nullptr);
+        return;
+    }
+
+    request.response = reply.body;
+    submit_response(session, id, nva, read_response);
+}
+
+void Http2Session::dispatch(std::int32_t id, Stream& request)
+{
+    request.answered = true;
+
+    // The work guard keeps run() from returning while the handler is still out
+    auto work = net::make_work_guard(ioc);
+    net::post(pool, [this, id, work, path = request.path, message = std::move(request.request)]() mutable
+    {
+        HTTPMessage reply = router.dispatch(path, message);
+        net::post(ioc, [this, id, work, reply = std::move(reply)]()
+        {
+            complete(id, reply);
+        });
+    });
+}
+
+void Http2Session::complete(std::int32_t id, const HTTPMessage& reply)
+{
+    // The client may have reset the stream, or the connection failed, while the handler ran
+    auto it = streams.find(id);
+    if (failure || it == streams.end())
+        return;
+
+    respond(id, it->second, reply);
+    flush();
+}
+
+int Http2Session::on_begin_headers(nghttp2_session*, const nghttp2_frame* frame, void* user_data)
+{
+    auto self = static_cast<Http2Session*>(user_data);
+
+    if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST)
+        return 0;
+
+    Stream& request = self->streams[frame->hd.stream_id];
+    request.request.isRequest = true;
+    request.request.remote_address = self->remote_address;
+    request.started = std::chrono::steady_clock::now();
+    return 0;
+}
+
+int Http2Session::on_header(nghttp2_session*, const nghttp2_frame* frame, const std::uint8_t* name, std::size_t namelen,
+                            const std::uint8_t* value, std::size_t valuelen, std::uint8_t, void* user_data)
+{
+    auto self = static_cast<Http2Session*>(user_data);
+
+    auto it = self->streams.find(frame->hd.stream_id);
+    if (it == self->streams.end() || it->second.answered)
+        return 0;
+
+    HTTPMessage& request = it->second.request;
+    std::string key(reinterpret_cast<const char*>(name), namelen);
+    std::string text(reinterpret_cast<const char*>(value), valuelen);
+
+    if (key == ":method")
+    {
+        it->second.method = text;
+        it->second.unsupported = !to_request_type(http::string_to_verb(text), request.type);
+    }
+    else if (key == ":path")
+        parse_target(text, it->second.path, request);
+    else if (key == ":authority")
+        request.header["Host"] = text;
+    else if (key[0] != ':')
+    {
+        // Handlers look headers up by their HTTP/1.1 spelling
+        auto field = http::string_to_field(key);
+        if (field != http::field::unknown)
+            key = std::string(http::to_string(field));
+
+        auto existing = request.header.find(key);
+        if (existing == request.header.end())
+            request.header[key] = text;
+        else
+            existing->second.append(field == http::field::cookie ? "; " : ", ").append(text);
+    }
+
+    return 0;
+}
+
+int Http2Session::on_data_chunk(nghttp2_session* session, std::uint8_t, std::int32_t stream_id, const std::uint8_t* data,
+                                std::size_t len, void* user_data)
+{
+    auto self = static_cast<Http2Session*>(user_data);
+
+    auto it = self->streams.find(stream_id);
+    if (it == self->streams.end())
+        return 0;
+
+    Stream& request = it->second;
+    if (request.rejected)
+    {
+        // Clients normally stop uploading once they see the rejection; those that
+        // keep going are cut off after another window's worth of data.
+        bool within_window = request.discarded <= stream_window_size;
+        request.discarded += len;
+        if (within_window && request.discarded > stream_window_size)
+            nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_id, NGHTTP2_NO_ERROR);
+        return 0;
+    }
+    if (request.answered)
+        return 0;
+
+    if (request.request.body.size() + len > request.limit)
+    {
+        HTTPMessage rejection;
+        rejection.status = http::status::payload_too_large;
+        self->reject(stream_id, request, rejection);
+        return 0;
+    }
+
+    request.request.body.append(reinterpret_cast<const char*>(data), len);
+    request.bytes_in += len;
+    return 0;
+}
+
+int Http2Session::on_frame_recv(nghttp2_session*, const nghttp2_frame* frame, void* user_data)
+{
+    auto self = static_cast<Http2Session*>(user_data);
+
+    auto it = self->streams.find(frame->hd.stream_id);
+    if (it == self->streams.end())
+        return 0;
+
+    Stream& request = it->second;
+
+    // Route, method, authorization and declared length are settled before any DATA frame
+    if (frame->hd.type == NGHTTP2_HEADERS && frame->headers.cat == NGHTTP2_HCAT_REQUEST)
+        self->admit(frame->hd.stream_id, request);
+
+    if ((frame->hd.type == NGHTTP2_HEADERS || frame->hd.type == NGHTTP2_DATA) &&
+        (frame->hd.flags & NGHTTP2_FLAG_END_STREAM) && !request.answered)
+    {
+        request.read_us = elapsed_us(request.started);
+
+        // Constant routes are answered right away, everything else goes to the pool
+        auto prebuilt = self->router.find_static(request.path, request.request.type);
+        if (prebuilt)
+            self->respond(frame->hd.stream_id, request, prebuilt->message);
+        else
+            self->dispatch(frame->hd.stream_id, request);
+    }
+
+    return 0;
+}
+
+int Http2Session::on_stream_close(nghttp2_session*, std::int32_t stream_id, std::uint32_t, void* user_data)
+{
+    auto self = static_cast<Http2Session*>(user_data);
+    self->streams.erase(stream_id);
+    return 0;
+}
+
+Http2Session::length_type Http2Session::read_response(nghttp2_session*, std::int32_t stream_id, std::uint8_t* buf, std::size_t length,
+                                    std::uint32_t* data_flags, nghttp2_data_source*, void* user_data)
+{
+    auto self = static_cast<Http2Session*>(user_data);
+
+    auto it = self->streams.find(stream_id);
+    if (it == self->streams.end())
+        return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+
+    Stream& request = it->second;
+    std::size_t count = std::min(length, request.response.size() - request.sent);
+    std::memcpy(buf, request.response.data() + request.sent, count);
+    request.sent += count;
+
+    if (request.sent == request.response.size())
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+
+    return count;
+}
+
+int select_alpn_protocol(SSL*, const unsigned char** out, unsigned char* outlen,
+                         const unsigned char* in, unsigned int inlen, void*)
+{
+    // Prefers h2, then http/1.1; clients offering neither carry on without ALPN
+#if NGHTTP2_VERSION_NUM >= 0x013c00
+    if (nghttp2_select_alpn(out, outlen, in, inlen) < 0)
+        return SSL_TLSEXT_ERR_NOACK;
+#else
+    if (nghttp2_select_next_protocol(const_cast<unsigned char**>(out), outlen, in, inlen) < 0)
+        return SSL_TLSEXT_ERR_NOACK;
+#endif
+
+    return SSL_TLSEXT_ERR_OK;
+}
@@ -0,0 +1,103 @@
+#ifndef FLEET_HTTP2SESSION_H
+#define FLEET_HTTP2SESSION_H
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/ssl.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/thread_pool.hpp>
+
+#include <nghttp2/nghttp2.h>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#include "AccessLog.h"
+#include "http_common.h"
+#include "RequestRouter.h"
+#include "Scoreboard.h"
+
+/*
+ * Serves one HTTP/2 connection negotiated through ALPN. nghttp2 takes care of
+ * framing, HPACK and flow control; every stream is admitted and dispatched to
+ * the RequestRouter exactly like an HTTP/1.1 request, and responses of all
+ * streams are interleaved on the same connection.
+ *
+ * Socket I/O and nghttp2 only ever run on the session's io_context. Complete
+ * requests are handed to a thread pool shared by all connections, so a slow
+ * handler holds up neither the other streams nor PING and WINDOW_UPDATE
+ * processing; replies are posted back and submitted from the session thread.
+ */
+class Http2Session
+{
+public:
+#if NGHTTP2_VERSION_NUM >= 0x013c00
+    typedef nghttp2_ssize length_type;
+#else
+    typedef ssize_t length_type;
+#endif
+private:
+    struct Stream
+    {
+        std::string path, method;
+        HTTPMessage request;
+        std::chrono::steady_clock::time_point started;
+        std::uint32_t read_us = 0;
+        std::uint64_t bytes_in = 0;
+        std::string response;
+        std::size_t sent = 0;
+        std::uint64_t limit = 0;
+        std::uint64_t discarded = 0;
+        bool unsupported = false;
+        bool answered = false;
+        bool rejected = false;
+    };
+
+    boost::beast::ssl_stream<boost::asio::ip::tcp::socket&>& stream;
+    boost::asio::io_context& ioc;
+    boost::asio::thread_pool& pool;
+    RequestRouter& router;
+    std::uint64_t body_limit;
+    std::string remote_address;
+    AccessLog* access_log;
+    WorkerSlot* counters;
+    nghttp2_session* session;
+    std::unordered_map<std::int32_t, Stream> streams;
+    std::array<std::uint8_t, 16384> incoming;
+    std::string outgoing;
+    bool reading, writing;
+    boost::beast::error_code failure;
+
+    void read();
+    void flush();
+    void fail(boost::beast::error_code ec);
+    void admit(std::int32_t id, Stream& request);
+    void dispatch(std::int32_t id, Stream& request);
+    void complete(std::int32_t id, const HTTPMessage& reply);
+    void reject(std::int32_t id, Stream& request, HTTPMessage& rejection);
+    void respond(std::int32_t id, Stream& request, const HTTPMessage& reply);
+
+    static int on_begin_headers(nghttp2_session*, const nghttp2_frame*, void*);
+    static int on_header(nghttp2_session*, const nghttp2_frame*, const std::uint8_t*, std::size_t,
+                         const std::uint8_t*, std::size_t, std::uint8_t, void*);
+    static int on_data_chunk(nghttp2_session*, std::uint8_t, std::int32_t, const std::uint8_t*, std::size_t, void*);
+    static int on_frame_recv(nghttp2_session*, const nghttp2_frame*, void*);
+    static int on_stream_close(nghttp2_session*, std::int32_t, std::uint32_t, void*);
+    static length_type read_response(nghttp2_session*, std::int32_t, std::uint8_t*, std::size_t, std::uint32_t*,
+                                 nghttp2_data_source*, void*);
+public:
+    Http2Session(boost::beast::ssl_stream<boost::asio::ip::tcp::socket&>& stream, boost::asio::io_context& ioc,
+                 boost::asio::thread_pool& pool, RequestRouter& router, std::uint64_t body_limit, std::string remote_address, AccessLog* access_log = nullptr, WorkerSlot* counters = nullptr);
+    ~Http2Session();
+    Http2Session(const Http2Session&) = delete;
+    Http2Session& operator=(const Http2Session&) = delete;
+    void run(boost::beast::error_code& ec);
+};
+
+int select_alpn_protocol(SSL* ssl, const unsigned char** out, unsigned char* outlen,
+                         const unsigned char* in, unsigned int inlen, void* arg);
+
+#endif //FLEET_HTTP2SESSION_H
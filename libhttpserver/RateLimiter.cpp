@@ -0,0 +1,200 @@
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <new>
+
+#include "RateLimiter.h"
+
+namespace
+{
+    const std::size_t shard_count = 16;
+    const std::size_t probe_length = 8;
+    const std::uint64_t one_token = 1ull << 16;
+
+    // Sessions racing on one bucket may see a refill stamped a little after their own clock reading
+    const std::int32_t clock_skew = 1000;
+
+    /*
+     * Milliseconds since the bucket was last refilled. The clock is 32 bits wide,
+     * so a bucket idle for more than ~24.8 days appears to have been refilled in
+     * the future; it is reported as idle for as long as can be represented, which
+     * refills it completely and makes it the first to be evicted. Past ~49.7 days
+     * the difference wraps around to a small value, which costs that client at
+     * most one ordinary refill period.
+     */
+    std::uint32_t since(std::uint32_t time, std::uint64_t bucket)
+    {
+        std::int32_t elapsed = static_cast<std::int32_t>(time - static_cast<std::uint32_t>(bucket >> 32));
+        if (elapsed >= 0)
+            return static_cast<std::uint32_t>(elapsed);
+        if (elapsed > -clock_skew)
+            return 0;
+
+        return std::numeric_limits<std::int32_t>::max();
+    }
+}
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "Rate limiter buckets must be lock-free to be shared between processes");
+
+RateLimiter::RateLimiter(double requests_per_second, double burst, std::string key_header, std::size_t max_clients)
+{
+    burst = std::min(std::max(burst, 1.0), 65535.0);
+    requests_per_second = std::max(requests_per_second, 0.001);
+
+    this->refill = requests_per_second * one_token / 1000.0;
+    this->capacity = static_cast<std::uint64_t>(burst * one_token);
+    this->wait = static_cast<unsigned>(std::ceil(1.0 / requests_per_second));
+    this->header = std::move(key_header);
+    this->shard_size = std::max(probe_length, max_clients / shard_count);
+    this->epoch = std::chrono::steady_clock::now();
+
+    // Shard counters first, then the slots of every shard back to back
+    this->mapping_size = sizeof(Shard) * shard_count + sizeof(Slot) * shard_count * shard_size;
+    void* memory = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        throw std::bad_alloc();
+
+    this->shards = static_cast<Shard*>(memory);
+    this->slots = reinterpret_cast<Slot*>(shards + shard_count);
+    for (std::size_t i = 0; i < shard_count; i++)
+    {
+        new (&shards[i]) Shard;
+    }
+    for (std::size_t i = 0; i < shard_count * shard_size; i++)
+    {
+        new (&slots[i]) Slot;
+    }
+}
+
+RateLimiter::~RateLimiter()
+{
+    munmap(shards, mapping_size);
+}
+
+std::uint32_t RateLimiter::now() const
+{
+    auto elapsed = std::chrono::steady_clock::now() - epoch;
+    return static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count());
+}
+
+std::string RateLimiter::key(const HTTPMessage& request) const
+{
+    if (header.empty())
+        return request.remote_address;
+
+    for (const auto& it : request.header)
+    {
+        if (boost::beast::iequals(it.first, header) && !it.second.empty())
+            return it.second;
+    }
+
+    // Clients without the header are told apart by address rather than sharing one
+    // bucket; the prefix keeps a header value from naming some other client's address.
+    return "peer " + request.remote_address;
+}
+
+RateLimiter::Slot& RateLimiter::find_slot(std::size_t shard, std::uint64_t hash, std::uint32_t time)
+{
+    Slot* shard_slots = slots + shard * shard_size;
+    std::size_t start = (hash / shard_count) % shard_size;
+    Slot* refilled = nullptr;
+    Slot* stalest = nullptr;
+    std::uint32_t stalest_idle = 0;
+
+    for (std::size_t i = 0; i < probe_length; i++)
+    {
+        Slot& slot = shard_slots[(start + i) % shard_size];
+        std::uint64_t key = slot.key.load(std::memory_order_acquire);
+
+        if (key == 0 && slot.key.compare_exchange_strong(key, hash, std::memory_order_acq_rel))
+        {
+            slot.bucket.store((std::uint64_t(time) << 32) | capacity, std::memory_order_release);
+            return slot;
+        }
+        if (key == hash)
+            return slot;
+
+        std::uint64_t bucket = slot.bucket.load(std::memory_order_relaxed);
+        std::uint32_t idle = since(time, bucket);
+        if (refilled == nullptr && (bucket & 0xffffffffull) + idle * refill >= capacity)
+            refilled = &slot;
+        if (stalest == nullptr || idle > stalest_idle)
+        {
+            stalest = &slot;
+            stalest_idle = idle;
+        }
+    }
+
+    // Every probed slot belongs to someone else. A full bucket is no different
+    // from a fresh one, so its slot is reused for free; failing that, the
+    // bucket idle the longest is evicted, handing its owner a full bucket too.
+    Slot* target = refilled ? refilled : stalest;
+    std::uint64_t key = target->key.load(std::memory_order_acquire);
+    if (key != hash && target->key.compare_exchange_strong(key, hash, std::memory_order_acq_rel))
+    {
+        target->bucket.store((std::uint64_t(time) << 32) | capacity, std::memory_order_release);
+        if (target != refilled)
+            shards[shard].evicted.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    return *target;
+}
+
+bool RateLimiter::allow(const std::string& key)
+{
+    // Zero marks an empty slot
+    std::uint64_t hash = std::hash<std::string>{}(key) | 1;
+    Shard& shard = shards[hash % shard_count];
+    std::uint32_t time = now();
+    Slot& slot = find_slot(hash % shard_count, hash, time);
+
+    std::uint64_t bucket = slot.bucket.load(std::memory_order_acquire);
+    for (;;)
+    {
+        std::uint64_t tokens = bucket & 0xffffffffull;
+        std::uint32_t refilled_at = static_cast<std::uint32_t>(bucket >> 32);
+
+        std::uint32_t elapsed = since(time, bucket);
+        std::uint64_t added = static_cast<std::uint64_t>(std::min<double>(elapsed * refill, capacity));
+        if (added > 0)
+        {
+            tokens = std::min(capacity, tokens + added);
+            refilled_at = time;
+        }
+
+        if (tokens < one_token)
+        {
+            shard.rejected.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        std::uint64_t next = (std::uint64_t(refilled_at) << 32) | (tokens - one_token);
+        if (slot.bucket.compare_exchange_weak(bucket, next, std::memory_order_acq_rel))
+        {
+            shard.admitted.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+}
+
+unsigned RateLimiter::retry_after() const
+{
+    return wait;
+}
+
+RateLimiter::Stats RateLimiter::stats() const
+{
+    Stats stats;
+
+    for (std::size_t i = 0; i < shard_count; i++)
+    {
+        stats.admitted += shards[i].admitted.load(std::memory_order_relaxed);
+        stats.rejected += shards[i].rejected.load(std::memory_order_relaxed);
+        stats.evicted += shards[i].evicted.load(std::memory_order_relaxed);
+    }
+
+    return stats;
+}
@@ -0,0 +1,70 @@
+#ifndef FLEET_RATELIMITER_H
+#define FLEET_RATELIMITER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "http_common.h"
+
+/*
+ * Token bucket limiter keyed by client address, or by the value of a request
+ * header when one is given; requests lacking that header are keyed by address.
+ * Buckets live in a fixed number of slots spread over shards, so memory stays
+ * bounded however many clients show up. A client's bucket is one of a few
+ * slots probed from its hash. An unseen client takes an empty slot there, or
+ * else one whose bucket has refilled completely, as such a bucket is no
+ * different from a new one. Only when neither exists is the bucket idle the
+ * longest evicted; that counts towards `evicted`, and its owner starts over
+ * with a full bucket when it returns. Buckets are only updated through
+ * compare-and-swap, so concurrent sessions never wait on each other. Like the
+ * Scoreboard, the table lives in anonymous shared memory, so prefork workers
+ * forked after the limiter was created draw on the same buckets.
+ */
+class RateLimiter
+{
+public:
+    struct Stats
+    {
+        std::uint64_t admitted = 0;
+        std::uint64_t rejected = 0;
+        std::uint64_t evicted = 0;
+    };
+private:
+    struct Slot
+    {
+        std::atomic<std::uint64_t> key{0};
+        // Last refill in milliseconds (high 32 bits), tokens in 1/65536ths (low 32 bits)
+        std::atomic<std::uint64_t> bucket{0};
+    };
+
+    struct alignas(64) Shard
+    {
+        std::atomic<std::uint64_t> admitted{0}, rejected{0}, evicted{0};
+    };
+
+    double refill;
+    std::uint64_t capacity;
+    unsigned wait;
+    std::string header;
+    std::size_t shard_size;
+    std::size_t mapping_size;
+    Shard* shards;
+    Slot* slots;
+    std::chrono::steady_clock::time_point epoch;
+
+    std::uint32_t now() const;
+    Slot& find_slot(std::size_t shard, std::uint64_t hash, std::uint32_t time);
+public:
+    RateLimiter(double requests_per_second, double burst, std::string key_header = "", std::size_t max_clients = 65536);
+    ~RateLimiter();
+    RateLimiter(const RateLimiter&) = delete;
+    RateLimiter& operator=(const RateLimiter&) = delete;
+    std::string key(const HTTPMessage& request) const;
+    bool allow(const std::string& key);
+    unsigned retry_after() const;
+    Stats stats() const;
+};
+
+#endif //FLEET_RATELIMITER_H
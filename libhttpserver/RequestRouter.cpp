@@ -1,3 +1,6 @@
+#include <atomic>
+#include <sstream>
+
 #include "RequestRouter.h"
 
 std::string destination(const ChainRouter& router)
@@ -5,6 +8,22 @@ std::string destination(const ChainRouter& router)
     return router.path;
 }
 
+bool over_limit(RateLimiter& limiter, const HTTPMessage& request, HTTPMessage& rejection)
+{
+    if (limiter.allow(limiter.key(request)))
+        return false;
+
+    rejection.status = boost::beast::http::status::too_many_requests;
+    rejection.header["Retry-After"] = std::to_string(limiter.retry_after());
+    return true;
+}
+
+bool wants_websocket(const HTTPMessage& request)
+{
+    auto upgrade = request.header.find("Upgrade");
+    return upgrade != request.header.end() && boost::beast::iequals(upgrade->second, "websocket");
+}
+
 bool default_invoke_handler(const std::string& destination, HTTPMessage& request)
 {
     return true;
@@ -35,6 +54,32 @@ HTTPMessage default_req_handler(const std::string& destination, const HTTPMessag
     return response;
 }
 
+StaticResponse::StaticResponse(HTTPMessage response, const std::string& path, const InvokeHandler& post_handler)
+    : source(std::move(response)), message(source)
+{
+    if (post_handler)
+        post_handler(path, message);
+
+    boost::beast::http::response<boost::beast::http::string_body> res{message.status, 11};
+
+    for (const auto& it : message.header)
+    {
+        res.set(it.first, it.second);
+    }
+
+    res.body() = message.body;
+    res.prepare_payload();
+
+    std::ostringstream ss;
+    ss << res;
+    wire = ss.str();
+    header_length = wire.size() - message.body.size();
+}
+
+ChainRouter::ChainRouter() : static_handler(std::make_shared<StaticRoute>())
+{
+}
+
 ChainRouter ChainRouter::route(std::string path)
 {
     this->path = path;
@@ -77,6 +122,120 @@ ChainRouter ChainRouter::head(std::function<HTTPMessage(const HTTPMessage&)> han
     return *this;
 }
 
+ChainRouter ChainRouter::get_static(const HTTPMessage& response)
+{
+    update_static(response);
+    return *this;
+}
+
+ChainRouter ChainRouter::get_static(boost::beast::http::status status, std::string body, std::unordered_map<std::string, std::string> header)
+{
+    HTTPMessage response;
+    response.status = status;
+    response.body = std::move(body);
+    response.header = std::move(header);
+    return get_static(response);
+}
+
+void ChainRouter::update_static(const HTTPMessage& response)
+{
+    auto prebuilt = std::make_shared<const StaticResponse>(response, path, static_handler->post_handler);
+    std::atomic_store(&static_handler->response, prebuilt);
+}
+
+std::shared_ptr<const StaticResponse> ChainRouter::static_response() const
+{
+    return std::atomic_load(&static_handler->response);
+}
+
+// Called by the RequestRouter the route is registered with; rebuilds a response registered before it
+void ChainRouter::finish_static(const InvokeHandler& post_invoke_handler)
+{
+    static_handler->post_handler = post_invoke_handler;
+
+    if (auto prebuilt = static_response())
+        update_static(prebuilt->source);
+}
+
+ChainRouter ChainRouter::body_limit(std::uint64_t limit)
+{
+    max_body_size = limit;
+    return *this;
+}
+
+std::uint64_t ChainRouter::body_limit() const
+{
+    return max_body_size;
+}
+
+ChainRouter ChainRouter::rate_limit(std::shared_ptr<RateLimiter> rate_limiter)
+{
+    limiter = std::move(rate_limiter);
+    return *this;
+}
+
+std::shared_ptr<RateLimiter> ChainRouter::rate_limit() const
+{
+    return limiter;
+}
+
+ChainRouter ChainRouter::websocket(WebSocketHandler handler)
+{
+    websocket_handler = std::make_shared<const WebSocketHandler>(std::move(handler));
+    return *this;
+}
+
+std::shared_ptr<const WebSocketHandler> ChainRouter::websocket() const
+{
+    return websocket_handler;
+}
+
+bool ChainRouter::websocket_only() const
+{
+    return websocket_handler && common_handler.empty() && get_handler.empty() && !static_response();
+}
+
+bool ChainRouter::accepts(RequestType type) const
+{
+    if (!common_handler.empty())
+        return true;
+
+    switch(type)
+    {
+        case RequestType::GET:
+            return !get_handler.empty() || static_response() || websocket_handler;
+        case RequestType::PUT:
+            return !put_handler.empty();
+        case RequestType::POST:
+            return !post_handler.empty();
+        case RequestType::DELETE:
+            return !delete_handler.empty();
+        case RequestType::HEAD:
+            return !head_handler.empty() || static_response();
+        case RequestType::OPTIONS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+std::string ChainRouter::allowed_methods() const
+{
+    std::string allowed_methods = "OPTIONS";
+    if (!get_handler.empty() || static_response() || websocket_handler)
+        allowed_methods.append(", GET");
+    if (!put_handler.empty())
+        allowed_methods.append(", PUT");
+    if (!post_handler.empty())
+        allowed_methods.append(", POST");
+    if (!delete_handler.empty())
+        allowed_methods.append(", DELETE");
+    if (!head_handler.empty() || static_response())
+        allowed_methods.append(", HEAD");
+
+    return allowed_methods;
+}
+
 HTTPMessage ChainRouter::operator()(const HTTPMessage& request)
 {
     HTTPMessage response, interim_request = request;
@@ -85,6 +244,12 @@ HTTPMessage ChainRouter::operator()(const HTTPMessage& request)
     switch(request.type)
     {
         case RequestType::GET:
+            if (auto prebuilt = static_response())
+            {
+                isProcessed = true;
+                response = prebuilt->message;
+                break;
+            }
             for (const auto& handler : get_handler)
             {
                 isProcessed = true;
@@ -133,6 +298,15 @@ HTTPMessage ChainRouter::operator()(const HTTPMessage& request)
             }
             break;
         case RequestType::HEAD:
+            if (auto prebuilt = static_response())
+            {
+                if (head_handler.empty())
+                {
+                    isProcessed = true;
+                    response = prebuilt->message;
+                    break;
+                }
+            }
             for (const auto& handler : head_handler)
             {
                 isProcessed = true;
@@ -147,17 +321,7 @@ HTTPMessage ChainRouter::operator()(const HTTPMessage& request)
         case RequestType::OPTIONS:
             {
                 isProcessed = true;
-                std::string allowed_methods= "OPTIONS";
-                if (!get_handler.empty())
-                    allowed_methods.append(", GET");
-                if (!put_handler.empty())
-                    allowed_methods.append(", PUT");
-                if (!post_handler.empty())
-                    allowed_methods.append(", POST");
-                if (!delete_handler.empty())
-                    allowed_methods.append(", DELETE");
-                if (!head_handler.empty())
-                    allowed_methods.append(", HEAD");
+                std::string allowed_methods = this->allowed_methods();
 
                 response.header["Allow"] = allowed_methods;
                 response.header["Access-Control-Allow-Methods"] = allowed_methods;
@@ -183,7 +347,10 @@ HTTPMessage ChainRouter::operator()(const HTTPMessage& request)
     }
 
     if (!isProcessed)
-        response.status = boost::beast::http::status::not_found;
+    {
+        response.status = boost::beast::http::status::method_not_allowed;
+        response.header["Allow"] = allowed_methods();
+    }
 
     return response;
 }
@@ -191,6 +358,7 @@ HTTPMessage ChainRouter::operator()(const HTTPMessage& request)
 RequestRouter RequestRouter::use(const ChainRouter& router)
 {
     route_handler[destination(router)] = router;
+    route_handler[destination(router)].finish_static(this->post_handler);
     return *this;
 }
 
@@ -199,22 +367,123 @@ RequestRouter RequestRouter::use(const std::vector<ChainRouter>& routers)
     for (const auto& router : routers)
     {
         route_handler[destination(router)] = router;
+        route_handler[destination(router)].finish_static(this->post_handler);
     }
     return *this;
 }
 
-HTTPMessage RequestRouter::run(const std::string& path, HTTPMessage& request)
+RequestRouter RequestRouter::rate_limit(std::shared_ptr<RateLimiter> rate_limiter)
 {
-    HTTPMessage response;
+    limiter = std::move(rate_limiter);
+    return *this;
+}
 
-    if (this->pre_handler(path, request))
+std::shared_ptr<const StaticResponse> RequestRouter::find_static(const std::string& path, RequestType type) const
+{
+    if (type != RequestType::GET && type != RequestType::HEAD)
+        return nullptr;
+
+    auto it = route_handler.find(path);
+    if (it == route_handler.end())
+        return nullptr;
+
+    // An explicit head() handler takes precedence over the static response
+    if (type == RequestType::HEAD && !it->second.head_handler.empty())
+        return nullptr;
+
+    return it->second.static_response();
+}
+
+std::uint64_t RequestRouter::body_limit(const std::string& path) const
+{
+    auto it = route_handler.find(path);
+    if (it == route_handler.end())
+        return 0;
+
+    return it->second.body_limit();
+}
+
+std::shared_ptr<const WebSocketHandler> RequestRouter::find_websocket(const std::string& path) const
+{
+    auto it = route_handler.find(path);
+    if (it == route_handler.end())
+        return nullptr;
+
+    return it->second.websocket();
+}
+
+bool RequestRouter::authorize(const std::string& path, HTTPMessage& request)
+{
+    return this->pre_handler(path, request);
+}
+
+/*
+ * Decides from the request line and headers alone whether the request body is
+ * worth reading. On refusal, `rejection` holds the response to send instead.
+ * Unknown destinations are answered here by the default handler, so it never
+ * sees a request body.
+ */
+bool RequestRouter::admit(const std::string& path, HTTPMessage& request, HTTPMessage& rejection)
+{
+    rejection = HTTPMessage();
+
+    auto it = route_handler.find(path);
+
+    // Rate limits come first, so rejected clients cost neither authorization nor handler work
+    if (limiter && over_limit(*limiter, request, rejection))
+        return false;
+    if (it != route_handler.end() && it->second.rate_limit() && over_limit(*it->second.rate_limit(), request, rejection))
+        return false;
+
+    if (!this->authorize(path, request))
+    {
+        rejection.status = boost::beast::http::status::unauthorized;
+        return false;
+    }
+
+    if (it == route_handler.end())
+    {
+        rejection = this->default_handler(path, request);
+        this->post_handler(path, rejection);
+        return false;
+    }
+
+    if (!it->second.accepts(request.type))
     {
-        response = this->operator[](path)(request);
-        this->post_handler(path, response);
+        rejection.status = boost::beast::http::status::method_not_allowed;
+        rejection.header["Allow"] = it->second.allowed_methods();
+        return false;
     }
-    else
+
+    // A route that only speaks WebSocket has nothing to send a plain GET
+    if (request.type == RequestType::GET && it->second.websocket_only() && !wants_websocket(request))
+    {
+        rejection.status = boost::beast::http::status::upgrade_required;
+        rejection.header["Upgrade"] = "websocket";
+        return false;
+    }
+
+    return true;
+}
+
+HTTPMessage RequestRouter::dispatch(const std::string& path, HTTPMessage& request)
+{
+    // Static responses went through the post hook when they were built
+    if (auto prebuilt = this->find_static(path, request.type))
+        return prebuilt->message;
+
+    HTTPMessage response = this->operator[](path)(request);
+    this->post_handler(path, response);
+    return response;
+}
+
+HTTPMessage RequestRouter::run(const std::string& path, HTTPMessage& request)
+{
+    HTTPMessage response;
+
+    if (this->admit(path, request, response))
     {
-        response.status = boost::beast::http::status::unauthorized;
+        response = this->dispatch(path, request);
     }
 
     return response;
@@ -224,11 +493,10 @@ ChainRouter& RequestRouter::operator[](const std::string& destination)
 {
     if (route_handler.find(destination) == route_handler.end())
     {
-        auto handler = std::bind(this->default_handler, destination, std::placeholders::_1);
         ChainRouter router;
         router.route(destination);
+        router.finish_static(this->post_handler);
         route_handler[destination] = router;
-        route_handler[destination].all(handler);
     }
 
     return route_handler[destination];
@@ -1,19 +1,56 @@
 #ifndef FLEET_REQUESTROUTER_H
 #define FLEET_REQUESTROUTER_H
 
+#include <cstdint>
 #include <functional>
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
 #include "http_common.h"
+#include "RateLimiter.h"
+#include "WebSocket.h"
+
+typedef std::function<bool(const std::string&, HTTPMessage&)> InvokeHandler;
+
+/*
+ * A constant response serialized once into an immutable buffer. Serving it is
+ * a single write of `wire`, or of its first `header_length` bytes for HEAD;
+ * `message` is kept for the regular response path. Both already carry the
+ * router's post hook, applied once when built; `source` is the response as it
+ * was registered.
+ */
+struct StaticResponse
+{
+    HTTPMessage source;
+    HTTPMessage message;
+    std::string wire;
+    std::size_t header_length;
+
+    StaticResponse(HTTPMessage response, const std::string& path, const InvokeHandler& post_handler);
+};
 
 class ChainRouter
 {
 private:
     std::string path;
     std::vector<std::function<HTTPMessage(const HTTPMessage&)>> common_handler, get_handler, post_handler, put_handler, delete_handler, head_handler;
+    struct StaticRoute
+    {
+        std::shared_ptr<const StaticResponse> response;
+        InvokeHandler post_handler;
+    };
+
+    // Shared by every copy of this router, so update_static() is visible wherever the route was registered.
+    std::shared_ptr<StaticRoute> static_handler;
+    std::uint64_t max_body_size = 0;
+    std::shared_ptr<RateLimiter> limiter;
+    std::shared_ptr<const WebSocketHandler> websocket_handler;
+    void finish_static(const InvokeHandler&);
+    bool websocket_only() const;
 public:
+    ChainRouter();
     ChainRouter route(std::string);
     ChainRouter get(std::function<HTTPMessage(const HTTPMessage&)>);
     ChainRouter put(std::function<HTTPMessage(const HTTPMessage&)>);
@@ -21,16 +58,33 @@ public:
     ChainRouter delete_(std::function<HTTPMessage(const HTTPMessage&)>);
     ChainRouter head(std::function<HTTPMessage(const HTTPMessage&)>);
     ChainRouter all(std::function<HTTPMessage(const HTTPMessage&)>);
+    // Also answers HEAD unless the route has a head() handler. The router's
+    // post hook runs once when the response is built, not per request.
+    ChainRouter get_static(const HTTPMessage&);
+    ChainRouter get_static(boost::beast::http::status, std::string body, std::unordered_map<std::string, std::string> header = {});
+    // In prefork mode this only reaches the process it is called in
+    void update_static(const HTTPMessage&);
+    std::shared_ptr<const StaticResponse> static_response() const;
+    ChainRouter body_limit(std::uint64_t);
+    std::uint64_t body_limit() const;
+    ChainRouter rate_limit(std::shared_ptr<RateLimiter>);
+    std::shared_ptr<RateLimiter> rate_limit() const;
+    ChainRouter websocket(WebSocketHandler);
+    std::shared_ptr<const WebSocketHandler> websocket() const;
+    bool accepts(RequestType) const;
+    std::string allowed_methods() const;
     HTTPMessage operator()(const HTTPMessage&);
 
     friend std::string destination(const ChainRouter& router);
+    friend class RequestRouter;
 };
 
 class RequestRouter {
 private:
     std::unordered_map<std::string, ChainRouter> route_handler;
     std::function<HTTPMessage(const std::string&, const HTTPMessage&)> default_handler;
-    std::function<bool(const std::string&, HTTPMessage&)> pre_handler, post_handler;
+    InvokeHandler pre_handler, post_handler;
+    std::shared_ptr<RateLimiter> limiter;
 protected:
 public:
     RequestRouter();
@@ -40,6 +94,13 @@ public:
     ChainRouter& operator[](const std::string& path);
     RequestRouter use(const ChainRouter&);
     RequestRouter use(const std::vector<ChainRouter>&);
+    RequestRouter rate_limit(std::shared_ptr<RateLimiter>);
+    std::shared_ptr<const StaticResponse> find_static(const std::string&, RequestType) const;
+    std::shared_ptr<const WebSocketHandler> find_websocket(const std::string&) const;
+    std::uint64_t body_limit(const std::string&) const;
+    bool authorize(const std::string&, HTTPMessage&);
+    bool admit(const std::string&, HTTPMessage&, HTTPMessage&);
+    HTTPMessage dispatch(const std::string&, HTTPMessage&);
     HTTPMessage run(const std::string&, HTTPMessage&);
 };
 
@@ -0,0 +1,58 @@
+#include <sys/mman.h>
+
+#include <new>
+
+#include "Scoreboard.h"
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "Scoreboard counters must be lock-free to be shared between processes");
+
+Scoreboard::Scoreboard(std::size_t workers) : slots(nullptr), count(workers)
+{
+    void* memory = mmap(nullptr, sizeof(WorkerSlot) * count, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        throw std::bad_alloc();
+
+    slots = static_cast<WorkerSlot*>(memory);
+    for (std::size_t i = 0; i < count; i++)
+    {
+        WorkerSlot* slot = new (&slots[i]) WorkerSlot;
+        slot->pid = 0;
+        slot->connections = 0;
+        slot->requests = 0;
+        slot->errors = 0;
+        slot->restarts = 0;
+    }
+}
+
+Scoreboard::~Scoreboard()
+{
+    munmap(slots, sizeof(WorkerSlot) * count);
+}
+
+WorkerSlot& Scoreboard::slot(std::size_t index)
+{
+    return slots[index];
+}
+
+std::size_t Scoreboard::size() const
+{
+    return count;
+}
+
+ServerMetrics Scoreboard::totals() const
+{
+    ServerMetrics metrics;
+    metrics.workers = count;
+
+    for (std::size_t i = 0; i < count; i++)
+    {
+        if (slots[i].pid.load(std::memory_order_relaxed) != 0)
+            metrics.running++;
+        metrics.connections += slots[i].connections.load(std::memory_order_relaxed);
+        metrics.requests += slots[i].requests.load(std::memory_order_relaxed);
+        metrics.errors += slots[i].errors.load(std::memory_order_relaxed);
+        metrics.restarts += slots[i].restarts.load(std::memory_order_relaxed);
+    }
+
+    return metrics;
+}
@@ -0,0 +1,49 @@
+#ifndef FLEET_SCOREBOARD_H
+#define FLEET_SCOREBOARD_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Counters of one serving process (or of the whole server in threaded mode)
+struct WorkerSlot
+{
+    std::atomic<std::int64_t> pid;
+    std::atomic<std::uint64_t> connections;
+    std::atomic<std::uint64_t> requests;
+    std::atomic<std::uint64_t> errors;
+    std::atomic<std::uint64_t> restarts;
+};
+
+struct ServerMetrics
+{
+    std::size_t workers = 0;
+    std::size_t running = 0;
+    std::uint64_t connections = 0;
+    std::uint64_t requests = 0;
+    std::uint64_t errors = 0;
+    std::uint64_t restarts = 0;
+};
+
+/*
+ * Per-worker counters in anonymous shared memory. Mapped before workers are
+ * forked, so every process updates its own slot and any of them, the
+ * supervisor included, can read the totals.
+ */
+class Scoreboard
+{
+private:
+    WorkerSlot* slots;
+    std::size_t count;
+public:
+    explicit Scoreboard(std::size_t workers);
+    ~Scoreboard();
+    Scoreboard(const Scoreboard&) = delete;
+    Scoreboard& operator=(const Scoreboard&) = delete;
+
+    WorkerSlot& slot(std::size_t index);
+    std::size_t size() const;
+    ServerMetrics totals() const;
+};
+
+#endif //FLEET_SCOREBOARD_H
@@ -1,39 +1,124 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
 #include <sstream>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 #include <boost/asio/io_service.hpp>
 #include <boost/tokenizer.hpp>
 
 #include "ssl_certificate.h"
 #include "WebServer.h"
+#ifdef WEBSERVER_HTTP2
+#include "Http2Session.h"
+#endif
 
 namespace beast = boost::beast;         // from <boost/beast.hpp>
 namespace http = beast::http;           // from <boost/beast/http.hpp>
+namespace websocket = beast::websocket; // from <boost/beast/websocket.hpp>
 namespace net = boost::asio;            // from <boost/asio.hpp>
 namespace ssl = boost::asio::ssl;       // from <boost/asio/ssl.hpp>
 using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
 
-void
-abort_server(beast::error_code ec, char const* what)
+namespace
 {
-    std::cerr << what << ": " << ec.message() << "\n";
+    // How long a prefork worker waits for a TLS handshake, or for the next request header
+    const std::chrono::milliseconds worker_deadline{std::chrono::seconds(5)};
+
+    // How long a prefork worker gives a client to send a request body, to take a
+    // response, or to complete the TLS shutdown
+    const std::chrono::milliseconds worker_transfer_deadline{std::chrono::seconds(30)};
+
+    /*
+     * Runs one asynchronous operation on the session's io_context to completion.
+     * With a deadline, the socket is closed if the operation has not finished in
+     * time, and the result is beast::error::timeout. The bytes the operation
+     * transferred are stored in `transferred` when given.
+     */
+    template<class Initiate>
+    beast::error_code
+    run_with_deadline(net::io_context& ioc, tcp::socket& socket, std::chrono::milliseconds deadline, Initiate&& initiate,
+                      std::size_t* transferred = nullptr)
+    {
+        beast::error_code result;
+        bool done = false;
+
+        ioc.restart();
+        initiate([&result, &done, transferred](beast::error_code ec, std::size_t bytes = 0)
+                 {
+                     result = ec;
+                     done = true;
+                     if (transferred)
+                         *transferred = bytes;
+                 });
+
+        if (deadline.count() == 0)
+        {
+            ioc.run();
+            return result;
+        }
+
+        ioc.run_for(deadline);
+        if (done)
+            return result;
+
+        // Closing the socket makes the operation complete; let it do so before returning
+        beast::error_code ignored;
+        socket.close(ignored);
+        ioc.restart();
+        ioc.run();
+        return beast::error::timeout;
+    }
+}
+
+void WebServer::abort_server(beast::error_code ec, char const* what, const std::string& peer)
+{
+    this->scoreboard->slot(this->worker_index).errors++;
+
+    if (this->access_log)
+        this->access_log->error(peer, what, ec.message());
+    else
+        std::cerr << what << ": " << ec.message() << "\n";
 }
 
 // This is the C++11 equivalent of a generic lambda.
 // The function object is used to send an HTTP message.
+// Writes run on the session's io_context, bounded by `deadline` unless it is zero.
 template<class Stream>
 struct send_lambda
 {
     Stream& stream_;
     bool& close_;
     beast::error_code& ec_;
+    unsigned& status_;
+    std::uint64_t& written_;
+    net::io_context& ioc_;
+    tcp::socket& socket_;
+    std::chrono::milliseconds deadline_;
 
     explicit
     send_lambda(
             Stream& stream,
             bool& close,
-            beast::error_code& ec)
+            beast::error_code& ec,
+            unsigned& status,
+            std::uint64_t& written,
+            net::io_context& ioc,
+            tcp::socket& socket,
+            std::chrono::milliseconds deadline)
             : stream_(stream)
             , close_(close)
             , ec_(ec)
+            , status_(status)
+            , written_(written)
+            , ioc_(ioc)
+            , socket_(socket)
+            , deadline_(deadline)
     {
     }
 
@@ -47,42 +132,214 @@ struct send_lambda
         // We need the serializer here because the serializer requires
         // a non-const file_body, and the message oriented version of
         // http::write only works with const messages.
+        status_ = msg.result_int();
         http::serializer<isRequest, Body, Fields> sr{msg};
-        http::write(stream_, sr, ec_);
+        std::size_t written = 0;
+        ec_ = run_with_deadline(ioc_, socket_, deadline_, [&](auto handler)
+                                {
+                                    http::async_write(stream_, sr, handler);
+                                }, &written);
+        written_ = written;
+    }
+
+    // Writes an already serialized response as-is. The caller keeps the
+    // buffer alive until this returns, by which time the write has finished.
+    void
+    operator()(net::const_buffer raw, bool keep_alive, http::status status) const
+    {
+        close_ = !keep_alive;
+        status_ = static_cast<unsigned>(status);
+        std::size_t written = 0;
+        ec_ = run_with_deadline(ioc_, socket_, deadline_, [&](auto handler)
+                                {
+                                    net::async_write(stream_, raw, handler);
+                                }, &written);
+        written_ = written;
     }
 };
 
-void WebServer::do_session(boost::asio::ip::tcp::socket &socket, boost::asio::ssl::context& ctx)
+// Builds the wire response for a router reply.
+http::response<http::string_body>
+make_response(const HTTPMessage& reply, unsigned version, bool keep_alive)
+{
+    http::response<http::string_body> res{reply.status, version};
+
+    for (auto &it : reply.header)
+    {
+        res.set(it.first, it.second);
+    }
+
+    res.body() = reply.body;
+    res.content_length(reply.body.length());
+    res.keep_alive(keep_alive);
+    res.prepare_payload();
+
+    return res;
+}
+
+// Fills in method, headers, path and query parameters of a request from its header alone.
+// Returns false for methods the router has no RequestType for.
+bool
+parse_request(const http::request_header<>& req, std::string& target_path, HTTPMessage& message)
+{
+    message.isRequest = true;
+
+    bool supported = to_request_type(req.method(), message.type);
+
+    std::stringstream sstr;
+
+    for (auto const& hdr : req)
+    {
+        // Known fields under their canonical spelling, as on HTTP/2; others as sent
+        sstr.str(std::string());
+        if (hdr.name() != http::field::unknown)
+            sstr << http::to_string(hdr.name());
+        else
+            sstr << hdr.name_string();
+
+        std::string name, value;
+        name = sstr.str();
+        sstr.str(std::string());
+
+        sstr << hdr.value();
+        value = sstr.str();
+
+        message.header[name] = value;
+    }
+
+    sstr.str(std::string());
+    sstr << req.target();
+
+    parse_target(sstr.str(), target_path, message);
+
+    return supported;
+}
+
+void WebServer::do_websocket(beast::ssl_stream<tcp::socket&>& stream, net::io_context& ioc,
+                             http::request<http::string_body>&& req, const std::string& target_path,
+                             const HTTPMessage& message, std::shared_ptr<const WebSocketHandler> handler)
+{
+    beast::error_code ec;
+    WebSocketConnection::stream_type ws{stream};
+
+    // Ping idle clients so dead ones are noticed and dropped
+    auto timeouts = websocket::stream_base::timeout::suggested(beast::role_type::server);
+    timeouts.keep_alive_pings = true;
+    ws.set_option(timeouts);
+
+    auto started = std::chrono::steady_clock::now();
+    ws.accept(req, ec);
+    if(ec)
+        return abort_server(ec, "accept", message.remote_address);
+
+    this->scoreboard->slot(this->worker_index).requests++;
+    if (this->access_log)
+        this->access_log->access(message.remote_address, req.method_string(), target_path,
+                                 static_cast<unsigned>(http::status::switching_protocols), 0, 0, 0, elapsed_us(started));
+
+    auto connection = std::make_shared<WebSocketConnection>(ws, target_path, message.remote_address, handler);
+    connection->run();
+
+    // Every read, write and callback of the connection runs here until it closes
+    ioc.restart();
+    ioc.run();
+    connection->detach();
+
+    if (handler->on_close)
+        handler->on_close(connection);
+}
+
+void WebServer::do_session(boost::asio::ip::tcp::socket &accepted, boost::asio::ssl::context& ctx)
 {
     bool close = false;
     beast::error_code ec;
+    WorkerSlot& counters = this->scoreboard->slot(this->worker_index);
+    counters.connections++;
+
+    // Known from accept() on, so that even a failed handshake is logged with its peer
+    std::string remote_address;
+    auto peer = accepted.remote_endpoint(ec);
+    if(!ec)
+        remote_address = peer.address().to_string();
+
+    // Move the connection onto an io_context of its own, so the asynchronous
+    // WebSocket phase can run on this thread.
+    net::io_context ioc{1};
+    tcp::socket socket{ioc};
+    auto protocol = accepted.local_endpoint(ec).protocol();
+    if(ec)
+        return abort_server(ec, "accept", remote_address);
+    socket.assign(protocol, accepted.release(ec), ec);
+    if(ec)
+        return abort_server(ec, "accept", remote_address);
 
     // Construct the stream around the socket
     beast::ssl_stream<tcp::socket&> stream{socket, ctx};
 
+    // Prefork workers serve one connection at a time, so there a client only
+    // gets a bounded time for the handshake, for each request header and body,
+    // for each response and for the shutdown.
+    auto deadline = this->workers != 0 ? worker_deadline : std::chrono::milliseconds::zero();
+    auto transfer_deadline = this->workers != 0 ? worker_transfer_deadline : std::chrono::milliseconds::zero();
+
     // Perform the SSL handshake
-    stream.handshake(ssl::stream_base::server, ec);
+    ec = run_with_deadline(ioc, socket, deadline, [&](auto handler)
+                           {
+                               stream.async_handshake(ssl::stream_base::server, handler);
+                           });
     if(ec)
-        return abort_server(ec, "handshake");
+        return abort_server(ec, "handshake", remote_address);
+
+#ifdef WEBSERVER_HTTP2
+    const unsigned char* protocol_id = nullptr;
+    unsigned int protocol_length = 0;
+    SSL_get0_alpn_selected(stream.native_handle(), &protocol_id, &protocol_length);
+
+    if (protocol_length == NGHTTP2_PROTO_VERSION_ID_LEN &&
+        std::memcmp(protocol_id, NGHTTP2_PROTO_VERSION_ID, NGHTTP2_PROTO_VERSION_ID_LEN) == 0)
+    {
+        Http2Session session{stream, ioc, *this->dispatch_pool, this->router, this->body_limit, remote_address,
+                             this->access_log.get(), &counters};
+        session.run(ec);
+
+        if (ec == net::error::eof || ec == boost::asio::ssl::error::stream_truncated)
+            return;
+        else if(ec)
+            return abort_server(ec, "http2", remote_address);
+
+        stream.shutdown(ec);
+        return;
+    }
+#endif
 
     // This buffer is required to persist across reads
     beast::flat_buffer buffer;
     beast::flat_buffer header_buffer;
 
     // This lambda is used to send messages
-    send_lambda<beast::ssl_stream<tcp::socket&>> lambda{stream, close, ec};
+    unsigned status = 0;
+    std::uint64_t written = 0;
+    send_lambda<beast::ssl_stream<tcp::socket&>> lambda{stream, close, ec, status, written, ioc, socket, transfer_deadline};
 
     for(;;)
     {
-        // Read a request
-        http::request<http::string_body> req;
+        // Read the request header first; the body is only read once the
+        // router has agreed to handle the request. Declared lengths are checked
+        // against the route limit below, not by the parser.
         http::request_parser<http::string_body> parser;
         parser.body_limit(std::numeric_limits<std::uint64_t>::max());
-        http::read(stream, buffer, parser, ec);
-        //http::read(stream, buffer, req, ec);
+        ec = run_with_deadline(ioc, socket, deadline, [&](auto handler)
+                               {
+                                   http::async_read_header(stream, buffer, parser, handler);
+                               });
 
         if(ec == http::error::end_of_stream)
             break;
+        else if (ec == beast::error::timeout && !parser.got_some() && buffer.size() == 0)
+        {
+            // An idle keep-alive connection; the socket is already closed
+            return;
+        }
         else if (ec == boost::asio::ssl::error::stream_truncated)
         {
             /*
@@ -91,13 +348,104 @@ void WebServer::do_session(boost::asio::ip::tcp::socket &socket, boost::asio::ss
             return;
         }
         else if(ec)
-            return abort_server(ec, "read");
+            return abort_server(ec, "read", remote_address);
+
+        auto started = std::chrono::steady_clock::now();
+        std::uint32_t read_us = 0;
+
+        std::string target_path;
+        HTTPMessage message, rejection;
+        bool supported = parse_request(parser.get().base(), target_path, message);
+        message.remote_address = remote_address;
+
+        std::string method(parser.get().method_string());
+        auto log_exchange = [&](std::uint64_t bytes_in)
+                            {
+                                counters.requests++;
+                                if (this->access_log)
+                                    this->access_log->access(remote_address, method, target_path, status, bytes_in,
+                                                             written, read_us, elapsed_us(started));
+                            };
+
+        std::uint64_t limit = this->router.body_limit(target_path);
+        if (limit == 0)
+            limit = this->body_limit;
+
+        bool admitted = supported && this->router.admit(target_path, message, rejection);
+        if (!supported)
+            rejection.status = http::status::not_implemented;
+        else if (admitted && parser.content_length() && *parser.content_length() > limit)
+        {
+            admitted = false;
+            rejection.status = http::status::payload_too_large;
+        }
+
+        // A WebSocket would keep a prefork worker from serving anyone else for as long as it stays open
+        bool upgrade = websocket::is_upgrade(parser.get());
+        if (admitted && upgrade && this->workers != 0 && this->router.find_websocket(target_path))
+        {
+            admitted = false;
+            rejection.status = http::status::not_implemented;
+        }
+
+        if (!admitted)
+        {
+            // An unread body is still on the wire, in which case the connection cannot be reused.
+            lambda(make_response(rejection, parser.get().version(), parser.get().keep_alive() && parser.is_done()));
+            log_exchange(0);
+            if(ec)
+                return abort_server(ec, "write", remote_address);
+            if(close)
+                break;
+            continue;
+        }
+
+        if (upgrade)
+        {
+            if (auto handler = this->router.find_websocket(target_path))
+                return do_websocket(stream, ioc, parser.release(), target_path, message, handler);
+        }
+
+        if (!parser.is_done() && beast::iequals(parser.get()[http::field::expect], "100-continue"))
+        {
+            http::response<http::empty_body> proceed{http::status::continue_, parser.get().version()};
+            ec = run_with_deadline(ioc, socket, transfer_deadline, [&](auto handler)
+                                   {
+                                       http::async_write(stream, proceed, handler);
+                                   });
+            if(ec)
+                return abort_server(ec, "write", remote_address);
+        }
+
+        parser.body_limit(limit);
+        ec = run_with_deadline(ioc, socket, transfer_deadline, [&](auto handler)
+                               {
+                                   http::async_read(stream, buffer, parser, handler);
+                               });
+
+        if (ec == http::error::body_limit)
+        {
+            // A body without Content-Length outgrew the limit part way through.
+            rejection.status = http::status::payload_too_large;
+            lambda(make_response(rejection, parser.get().version(), false));
+            log_exchange(parser.get().body().size());
+            if(ec)
+                return abort_server(ec, "write", remote_address);
+            break;
+        }
+        else if (ec == boost::asio::ssl::error::stream_truncated)
+            return;
+        else if(ec)
+            return abort_server(ec, "read", remote_address);
+
+        read_us = elapsed_us(started);
+        std::uint64_t bytes_in = parser.get().body().size();
 
         // Send the response
-        auto _req = parser.get();
-        handle_request(std::move(_req), lambda);
+        handle_request(parser.release(), target_path, message, lambda);
+        log_exchange(bytes_in);
         if(ec)
-            return abort_server(ec, "write");
+            return abort_server(ec, "write", remote_address);
         if(close)
         {
             // This means we should close the connection, usually because
@@ -107,13 +455,151 @@ void WebServer::do_session(boost::asio::ip::tcp::socket &socket, boost::asio::ss
     }
 
     // Perform the SSL shutdown
-    stream.shutdown(ec);
+    ec = run_with_deadline(ioc, socket, transfer_deadline, [&](auto handler)
+                           {
+                               stream.async_shutdown(handler);
+                           });
     if(ec)
-        return abort_server(ec, "shutdown");
+        return abort_server(ec, "shutdown", remote_address);
 
     // At this point the connection is closed gracefully
 }
 
+void WebServer::serve(tcp::acceptor& acceptor, ssl::context& ctx, net::io_context& ioc, bool threaded)
+{
+    // Created here rather than in setAccessLog(), so that every worker process has its own writer thread
+    if (this->access_log_enabled)
+        this->access_log = std::make_shared<AccessLog>(this->access_log_path);
+
+#ifdef WEBSERVER_HTTP2
+    // Handlers of HTTP/2 streams run here, so one connection can have many requests
+    // in progress. Prefork workers do not offer h2, so they have no use for it.
+    if (threaded)
+        this->dispatch_pool = std::make_shared<net::thread_pool>(this->http2_threads);
+#endif
+
+    for(;;)
+    {
+        // This will receive the new connection
+        tcp::socket socket{ioc};
+
+        // Block until we get a connection
+        acceptor.accept(socket);
+
+        if (threaded)
+        {
+            // Launch the session, transferring ownership of the socket
+            std::thread{std::bind(&WebServer::do_session, this, std::move(socket), std::ref(ctx))}.detach();
+        }
+        else
+        {
+            // Workers serve one connection at a time, so handlers never run concurrently within a process
+            do_session(socket, ctx);
+        }
+    }
+}
+
+// Returns false if the worker could not be forked, leaving its slot empty.
+bool WebServer::spawn_worker(std::size_t index, std::vector<pid_t>& pids, tcp::acceptor& acceptor,
+                             ssl::context& ctx, net::io_context& ioc)
+{
+    pid_t supervisor = getpid();
+
+    ioc.notify_fork(net::execution_context::fork_prepare);
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        ioc.notify_fork(net::execution_context::fork_child);
+
+#ifdef __linux__
+        // Workers go down with the supervisor
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+        if (getppid() != supervisor)
+            _exit(EXIT_FAILURE);
+
+        this->worker_index = index;
+        this->scoreboard->slot(index).pid = getpid();
+
+        try
+        {
+            serve(acceptor, ctx, ioc, false);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Error: worker " << index << ": " << e.what() << std::endl;
+        }
+
+        // Never return into the caller of run() from a worker
+        _exit(EXIT_FAILURE);
+    }
+
+    ioc.notify_fork(net::execution_context::fork_parent);
+
+    if (pid < 0)
+    {
+        std::cerr << "Error: could not start worker " << index << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    pids[index] = pid;
+    this->scoreboard->slot(index).pid = pid;
+    return true;
+}
+
+void WebServer::supervise(tcp::acceptor& acceptor, ssl::context& ctx, net::io_context& ioc)
+{
+    // A zero pid marks a slot without a running worker
+    std::vector<pid_t> pids(this->workers, 0);
+
+    for(;;)
+    {
+        bool missing = false;
+        for (std::size_t i = 0; i < pids.size(); i++)
+        {
+            if (pids[i] == 0 && !spawn_worker(i, pids, acceptor, ctx, ioc))
+                missing = true;
+        }
+
+        // While a slot is empty, only poll for exited workers, so the spawn is retried
+        int status = 0;
+        pid_t pid = waitpid(-1, &status, missing ? WNOHANG : 0);
+
+        if (pid < 0 && errno == EINTR)
+            continue;
+        if (pid < 0 && errno != ECHILD)
+        {
+            std::cerr << "Error: waitpid: " << std::strerror(errno) << std::endl;
+            return;
+        }
+        if (pid <= 0)
+        {
+            // Nothing exited, but some worker could not be forked; try again shortly
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+        }
+
+        auto it = std::find(pids.begin(), pids.end(), pid);
+        if (it == pids.end())
+            continue;
+
+        std::size_t index = it - pids.begin();
+        pids[index] = 0;
+        WorkerSlot& slot = this->scoreboard->slot(index);
+        slot.pid = 0;
+        slot.restarts++;
+
+        if (WIFSIGNALED(status))
+            std::cerr << "Error: worker " << index << " killed by signal " << WTERMSIG(status) << ", restarting." << std::endl;
+        else
+            std::cerr << "Error: worker " << index << " exited with status " << WEXITSTATUS(status) << ", restarting." << std::endl;
+
+        // Keeps a worker that fails on startup from spinning the supervisor
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+}
+
 void WebServer::run()
 {
     try
@@ -137,20 +623,26 @@ void WebServer::run()
         // This holds the self-signed certificate used by the server
         load_server_certificate(ctx, this->ssl_certificate, this->ssl_private_key, this->diffie_hellman_key, this->private_key_password);
 
-        // The acceptor receives incoming connections
-        tcp::acceptor acceptor{ioc, {address, port}};
+#ifdef WEBSERVER_HTTP2
+        // Offer h2 to clients that ask for it through ALPN. Prefork workers stick
+        // to HTTP/1.1, as one multiplexed connection would occupy a whole worker.
+        if (this->workers == 0)
+            SSL_CTX_set_alpn_select_cb(ctx.native_handle(), select_alpn_protocol, nullptr);
+#endif
 
-        for(;;)
-        {
-            // This will receive the new connection
-            tcp::socket socket{ioc};
+        // The acceptor receives incoming connections; in prefork mode it is bound
+        // once here and inherited by every worker.
+        tcp::acceptor acceptor{ioc, {address, port}};
 
-            // Block until we get a connection
-            acceptor.accept(socket);
+        this->scoreboard = std::make_shared<Scoreboard>(std::max(this->workers, 1u));
 
-            // Launch the session, transferring ownership of the socket
-            std::thread{std::bind(&WebServer::do_session, this, std::move(socket), std::ref(ctx))}.detach();
+        if (this->workers == 0)
+        {
+            this->scoreboard->slot(0).pid = getpid();
+            serve(acceptor, ctx, ioc, true);
         }
+        else
+            supervise(acceptor, ctx, ioc);
     }
     catch (const std::exception& e)
     {
@@ -159,117 +651,35 @@ void WebServer::run()
 }
 
 template<class Body, class Allocator, class Send>
-void WebServer::handle_request(boost::beast::http::request<Body, boost::beast::http::basic_fields<Allocator>>&& req, Send&& send)
+void WebServer::handle_request(boost::beast::http::request<Body, boost::beast::http::basic_fields<Allocator>>&& req,
+                               const std::string& target_path, HTTPMessage& message, Send&& send)
 {
-    // Returns a bad request response
-    auto const bad_request =
-            [&req](beast::string_view why)
-            {
-                http::response<http::string_body> res{http::status::bad_request, req.version()};
-                res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-                res.set(http::field::content_type, "text/html");
-                res.keep_alive(req.keep_alive());
-                res.body() = std::string(why);
-                res.prepare_payload();
-                return res;
-            };
-
-    HTTPMessage message;
-    message.isRequest = true;
-
-    if (req.method() == http::verb::get)
-        message.type = RequestType::GET;
-    else if (req.method() == http::verb::post)
-        message.type = RequestType::POST;
-    else if (req.method() == http::verb::delete_)
-        message.type = RequestType::DELETE;
-    else if (req.method() == http::verb::put)
-        message.type = RequestType::PUT;
-    else if (req.method() == http::verb::head)
-        message.type = RequestType::HEAD;
-    else if (req.method() == http::verb::options)
-        message.type = RequestType::OPTIONS;
-
-    std::stringstream sstr;
-
-    for (auto const& hdr : req)
-    {
-        sstr.str(std::string());
-        sstr << hdr.name();
-
-        std::string name, value;
-        name = sstr.str();
-        sstr.str(std::string());
-
-        sstr << hdr.value();
-        value = sstr.str();
-
-        message.header[name] = value;
-    }
-
-    message.body = req.body();
-    sstr.str(std::string());
-    sstr << req.target();
-
-    std::string target_path = sstr.str();
-    std::string query_string;
-    boost::escaped_list_separator<char> query_separator("", "?", "\"\'");
-    boost::escaped_list_separator<char> query_param_separator("", "&", "\"\'");
-    boost::escaped_list_separator<char> key_separator("", "=", "\"\'");
-    boost::tokenizer<boost::escaped_list_separator<char>> url_tokens(target_path, query_separator);
+    // The request has already been admitted (and authorized) by the router
+    message.body = std::move(req.body());
 
-    bool target_reset = true;
-
-    for(const auto& it : url_tokens)
+    // Constant routes are written straight from their prebuilt buffer. The
+    // buffer is serialized as HTTP/1.1, so older clients take the regular path.
+    auto prebuilt = this->router.find_static(target_path, message.type);
+    if (prebuilt && req.version() == 11)
     {
-        if (target_reset) {
-            target_path = it;
-            target_reset = false;
-        }
-        else
-            query_string = it;
-    }
-
-    boost::tokenizer<boost::escaped_list_separator<char>> query_tokens(query_string, query_param_separator);
-    for(const auto& it: query_tokens)
-    {
-        // Here, we will get a key-value pair in each step. We can split that, and populate HTTPMessage::populate
-        bool isKey = true;
-        std::string key, value;
-        boost::tokenizer<boost::escaped_list_separator<char>> key_value(it, key_separator);
-        for(const auto& token : key_value)
-        {
-            if (isKey)
-            {
-                key = token;
-                isKey = false;
-            }
-            else
-            {
-                value = token;
-            }
-        }
-
-        message.query[key] = value;
+        std::size_t length = message.type == RequestType::HEAD ? prebuilt->header_length : prebuilt->wire.size();
+        return send(net::buffer(prebuilt->wire.data(), length), req.keep_alive(), prebuilt->message.status);
     }
 
     //auto _connection = pool->GetConnection();
     //HTTPMessage reply = this->operator[](target_path)(message, _connection);
-    HTTPMessage reply = this->router.run(target_path, message);
+    HTTPMessage reply = this->router.dispatch(target_path, message);
     //pool->ReturnConnection(_connection);
 
-    http::response<http::string_body> res{reply.status, req.version()};
-
-    for (auto &it : reply.header)
+    auto res = make_response(reply, req.version(), req.keep_alive());
+    if (message.type == RequestType::HEAD)
     {
-        res.set(it.first, it.second);
+        // Keep the Content-Length a GET would have had, but send no body
+        auto length = res.body().size();
+        res.body().clear();
+        res.content_length(length);
     }
 
-    res.body() = reply.body;
-    res.content_length(reply.body.length());
-    res.keep_alive(req.keep_alive());
-    res.prepare_payload();
-
     return send(std::move(res));
 }
 
@@ -278,6 +688,11 @@ WebServer::WebServer(RequestRouter router, std::string host, unsigned short port
     this->router = router;
     this->host = std::move(host);
     this->port = port;
+    this->body_limit = 16 * 1024 * 1024;
+    this->access_log_enabled = false;
+    this->workers = 0;
+    this->http2_threads = 64;
+    this->worker_index = 0;
 }
 
 void WebServer::setTlsCertificates(std::string ssl_certificate, std::string ssl_private_key,
@@ -287,4 +702,51 @@ void WebServer::setTlsCertificates(std::string ssl_certificate, std::string ssl_
     this->ssl_private_key = ssl_private_key;
     this->diffie_hellman_key = diffie_hellman_key;
     this->private_key_password = private_key_password;
+}
+
+void WebServer::setAccessLog(std::string path)
+{
+    this->access_log_path = std::move(path);
+    this->access_log_enabled = true;
+}
+
+/*
+ * Serves from `workers` forked processes instead of a thread per connection;
+ * zero (the default) keeps the threaded mode. Each worker serves one connection
+ * at a time, so handlers need not be thread-safe, but a connection occupies a
+ * worker for as long as it stays open. Workers therefore bound every read
+ * and write: a connection is closed when the client takes longer than five
+ * seconds to complete the TLS handshake or to send the next request header,
+ * or longer than thirty seconds to send a request body, to take a response or
+ * to complete the TLS shutdown. They answer WebSocket upgrades with 501, and
+ * HTTP/2 is not offered; these need the threaded mode.
+ *
+ * Workers are forked from the router as it stands when run() is called. Rate
+ * limiter buckets sit in shared memory and are shared by all of them; anything
+ * else is per process. update_static() and WebSocketChannel only reach the
+ * process they are called in, and state a handler keeps is not seen by the
+ * other workers.
+ */
+void WebServer::setWorkers(unsigned workers)
+{
+    this->workers = workers;
+}
+
+// Size of the pool running handlers for HTTP/2 streams, shared by all connections
+void WebServer::setHttp2Threads(unsigned threads)
+{
+    this->http2_threads = std::max(threads, 1u);
+}
+
+ServerMetrics WebServer::metrics() const
+{
+    if (!this->scoreboard)
+        return ServerMetrics();
+
+    return this->scoreboard->totals();
+}
+
+void WebServer::setBodyLimit(std::uint64_t limit)
+{
+    this->body_limit = limit;
 }
\ No newline at end of file
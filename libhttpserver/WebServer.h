@@ -9,34 +9,63 @@
 #include <boost/beast/http.hpp>
 #include <boost/beast/ssl.hpp>
 #include <boost/beast/version.hpp>
+#include <boost/beast/websocket.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/ssl/stream.hpp>
+#include <boost/asio/thread_pool.hpp>
 #include <boost/config.hpp>
+#include <cstdint>
 #include <cstdlib>
 #include <functional>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <sys/types.h>
 #include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include <memory>
+#include "AccessLog.h"
 #include "http_common.h"
 #include "RequestRouter.h"
+#include "Scoreboard.h"
+#include "WebSocket.h"
 
 class WebServer {
 private:
     std::string ssl_certificate, ssl_private_key, diffie_hellman_key, private_key_password;
     std::string host;
     unsigned short port;
+    std::uint64_t body_limit;
+    std::string access_log_path;
+    bool access_log_enabled;
+    std::shared_ptr<AccessLog> access_log;
+    unsigned workers;
+    unsigned http2_threads;
+    std::size_t worker_index;
+    std::shared_ptr<Scoreboard> scoreboard;
+    std::shared_ptr<boost::asio::thread_pool> dispatch_pool;
+    void serve(boost::asio::ip::tcp::acceptor& acceptor, boost::asio::ssl::context& ctx, boost::asio::io_context& ioc, bool threaded);
+    bool spawn_worker(std::size_t index, std::vector<pid_t>& pids, boost::asio::ip::tcp::acceptor& acceptor,
+                     boost::asio::ssl::context& ctx, boost::asio::io_context& ioc);
+    void supervise(boost::asio::ip::tcp::acceptor& acceptor, boost::asio::ssl::context& ctx, boost::asio::io_context& ioc);
+    void abort_server(boost::beast::error_code ec, char const* what, const std::string& peer);
     void do_session( boost::asio::ip::tcp::socket& socket, boost::asio::ssl::context& ctx);
+    void do_websocket(boost::beast::ssl_stream<boost::asio::ip::tcp::socket&>& stream, boost::asio::io_context& ioc,
+                      boost::beast::http::request<boost::beast::http::string_body>&& req, const std::string& target_path,
+                      const HTTPMessage& message, std::shared_ptr<const WebSocketHandler> handler);
     template<class Body, class Allocator, class Send> void handle_request(boost::beast::http::request<Body,
-            boost::beast::http::basic_fields<Allocator>>&& req, Send&& send);
+            boost::beast::http::basic_fields<Allocator>>&& req, const std::string& target_path, HTTPMessage& message, Send&& send);
     RequestRouter router;
 public:
     WebServer(RequestRouter router, std::string host = "0.0.0.0", unsigned short port = 1234);
     void setTlsCertificates(std::string ssl_certificate, std::string ssl_private_key, std::string diffie_hellman_key, std::string private_key_password);
+    void setBodyLimit(std::uint64_t limit);
+    void setAccessLog(std::string path = "");
+    void setWorkers(unsigned workers);
+    void setHttp2Threads(unsigned threads);
+    ServerMetrics metrics() const;
     void run();
 };
 
@@ -0,0 +1,232 @@
+#include "WebSocket.h"
+
+namespace beast = boost::beast;         // from <boost/beast.hpp>
+namespace websocket = beast::websocket; // from <boost/beast/websocket.hpp>
+namespace net = boost::asio;            // from <boost/asio.hpp>
+
+WebSocketConnection::WebSocketConnection(stream_type& stream, std::string destination, std::string remote_address,
+                                         std::shared_ptr<const WebSocketHandler> handler)
+    : ws(stream), path(std::move(destination)), address(std::move(remote_address)), handler(std::move(handler)),
+      open(true), queued(0), writing(false), closing(false)
+{
+}
+
+bool WebSocketConnection::post(std::function<void()> work)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!open)
+        return false;
+
+    net::post(ws.get_executor(), std::move(work));
+    return true;
+}
+
+void WebSocketConnection::run()
+{
+    if (handler->on_open)
+        handler->on_open(shared_from_this());
+
+    do_read();
+}
+
+void WebSocketConnection::detach()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    open = false;
+}
+
+void WebSocketConnection::do_read()
+{
+    auto self = shared_from_this();
+    ws.async_read(inbox, [self](beast::error_code ec, std::size_t)
+    {
+        // Closed by the peer, dropped as a slow consumer or timed out
+        if (ec)
+            return;
+
+        if (self->handler->on_message)
+            self->handler->on_message(self, beast::buffers_to_string(self->inbox.data()));
+
+        self->inbox.consume(self->inbox.size());
+        self->do_read();
+    });
+}
+
+void WebSocketConnection::do_write()
+{
+    if (outbox.empty())
+    {
+        if (closing)
+            do_close();
+        return;
+    }
+
+    writing = true;
+    auto self = shared_from_this();
+    ws.async_write(net::buffer(*outbox.front()), [self](beast::error_code ec, std::size_t)
+    {
+        self->writing = false;
+        self->outbox.pop_front();
+        self->queued.fetch_sub(1, std::memory_order_relaxed);
+
+        // A failed write also fails the pending read, which ends the session
+        if (ec)
+            return;
+
+        self->do_write();
+    });
+}
+
+void WebSocketConnection::do_close()
+{
+    auto self = shared_from_this();
+    ws.async_close(websocket::close_code::normal, [self](beast::error_code) {});
+}
+
+bool WebSocketConnection::send(std::shared_ptr<const std::string> message)
+{
+    auto self = shared_from_this();
+
+    if (queued.fetch_add(1, std::memory_order_relaxed) >= handler->max_queue)
+    {
+        // Slow consumer: drop the connection instead of buffering without bound
+        queued.fetch_sub(1, std::memory_order_relaxed);
+        post([self]()
+        {
+            beast::error_code ec;
+            beast::get_lowest_layer(self->ws).close(ec);
+        });
+        return false;
+    }
+
+    bool posted = post([self, message]()
+    {
+        if (self->closing)
+        {
+            self->queued.fetch_sub(1, std::memory_order_relaxed);
+            return;
+        }
+
+        self->outbox.push_back(message);
+        if (!self->writing)
+            self->do_write();
+    });
+
+    if (!posted)
+        queued.fetch_sub(1, std::memory_order_relaxed);
+
+    return posted;
+}
+
+bool WebSocketConnection::send(std::string message)
+{
+    return send(std::make_shared<const std::string>(std::move(message)));
+}
+
+void WebSocketConnection::close()
+{
+    auto self = shared_from_this();
+    post([self]()
+    {
+        if (self->closing)
+            return;
+
+        self->closing = true;
+        if (!self->writing)
+            self->do_close();
+    });
+}
+
+bool WebSocketConnection::is_open()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return open;
+}
+
+const std::string& WebSocketConnection::destination() const
+{
+    return path;
+}
+
+const std::string& WebSocketConnection::remote_address() const
+{
+    return address;
+}
+
+WebSocketChannel::WebSocketChannel()
+    : subscribers(std::make_shared<const std::vector<std::weak_ptr<WebSocketConnection>>>()), dropped_messages(0)
+{
+}
+
+void WebSocketChannel::subscribe(const std::shared_ptr<WebSocketConnection>& connection)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto updated = *std::atomic_load(&subscribers);
+    updated.push_back(connection);
+    std::atomic_store(&subscribers, std::shared_ptr<const std::vector<std::weak_ptr<WebSocketConnection>>>(
+            std::make_shared<std::vector<std::weak_ptr<WebSocketConnection>>>(std::move(updated))));
+}
+
+void WebSocketChannel::unsubscribe(const std::shared_ptr<WebSocketConnection>& connection)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<std::weak_ptr<WebSocketConnection>> updated;
+    for (const auto& it : *std::atomic_load(&subscribers))
+    {
+        auto subscriber = it.lock();
+        if (subscriber && subscriber != connection)
+            updated.push_back(subscriber);
+    }
+    std::atomic_store(&subscribers, std::shared_ptr<const std::vector<std::weak_ptr<WebSocketConnection>>>(
+            std::make_shared<std::vector<std::weak_ptr<WebSocketConnection>>>(std::move(updated))));
+}
+
+void WebSocketChannel::prune()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<std::weak_ptr<WebSocketConnection>> updated;
+    for (const auto& it : *std::atomic_load(&subscribers))
+    {
+        auto subscriber = it.lock();
+        if (subscriber && subscriber->is_open())
+            updated.push_back(subscriber);
+    }
+    std::atomic_store(&subscribers, std::shared_ptr<const std::vector<std::weak_ptr<WebSocketConnection>>>(
+            std::make_shared<std::vector<std::weak_ptr<WebSocketConnection>>>(std::move(updated))));
+}
+
+std::size_t WebSocketChannel::broadcast(std::string message)
+{
+    auto buffer = std::make_shared<const std::string>(std::move(message));
+    auto snapshot = std::atomic_load(&subscribers);
+    std::size_t delivered = 0;
+    bool stale = false;
+
+    for (const auto& it : *snapshot)
+    {
+        auto subscriber = it.lock();
+        if (!subscriber)
+            stale = true;
+        else if (subscriber->send(buffer))
+            delivered++;
+        else if (!subscriber->is_open())
+            stale = true;
+        else
+            dropped_messages.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (stale)
+        prune();
+
+    return delivered;
+}
+
+std::size_t WebSocketChannel::size() const
+{
+    return std::atomic_load(&subscribers)->size();
+}
+
+std::uint64_t WebSocketChannel::dropped() const
+{
+    return dropped_messages.load(std::memory_order_relaxed);
+}
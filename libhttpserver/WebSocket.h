@@ -0,0 +1,95 @@
+#ifndef FLEET_WEBSOCKET_H
+#define FLEET_WEBSOCKET_H
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/ssl.hpp>
+#include <boost/beast/websocket.hpp>
+#include <boost/beast/websocket/ssl.hpp>
+#include <boost/asio/ip/tcp.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "http_common.h"
+
+class WebSocketConnection;
+
+struct WebSocketHandler
+{
+    std::function<void(const std::shared_ptr<WebSocketConnection>&)> on_open;
+    std::function<void(const std::shared_ptr<WebSocketConnection>&, const std::string&)> on_message;
+    std::function<void(const std::shared_ptr<WebSocketConnection>&)> on_close;
+    // Messages a client may have waiting before it is dropped as a slow consumer
+    std::size_t max_queue = 256;
+};
+
+/*
+ * An upgraded connection. Its stream is owned by the session thread, which
+ * runs every read, write and callback; send() and close() may be called from
+ * any thread and only hand work over to it.
+ */
+class WebSocketConnection : public std::enable_shared_from_this<WebSocketConnection>
+{
+public:
+    using stream_type = boost::beast::websocket::stream<boost::beast::ssl_stream<boost::asio::ip::tcp::socket&>&>;
+private:
+    stream_type& ws;
+    std::string path, address;
+    std::shared_ptr<const WebSocketHandler> handler;
+
+    // Guards `open` against the session tearing the stream down
+    std::mutex mutex;
+    bool open;
+    std::atomic<std::size_t> queued;
+
+    // Only touched on the session thread
+    std::deque<std::shared_ptr<const std::string>> outbox;
+    boost::beast::flat_buffer inbox;
+    bool writing, closing;
+
+    bool post(std::function<void()> work);
+    void do_read();
+    void do_write();
+    void do_close();
+public:
+    WebSocketConnection(stream_type& stream, std::string destination, std::string remote_address,
+                        std::shared_ptr<const WebSocketHandler> handler);
+    void run();
+    void detach();
+    bool send(std::shared_ptr<const std::string> message);
+    bool send(std::string message);
+    void close();
+    bool is_open();
+    const std::string& destination() const;
+    const std::string& remote_address() const;
+};
+
+/*
+ * A set of connections receiving the same messages. A broadcast message is
+ * allocated once and the buffer is shared by every subscriber's write.
+ * Subscribers are held in memory, so a channel only spans one process.
+ */
+class WebSocketChannel
+{
+private:
+    std::mutex mutex;
+    std::shared_ptr<const std::vector<std::weak_ptr<WebSocketConnection>>> subscribers;
+    std::atomic<std::uint64_t> dropped_messages;
+
+    void prune();
+public:
+    WebSocketChannel();
+    void subscribe(const std::shared_ptr<WebSocketConnection>&);
+    void unsubscribe(const std::shared_ptr<WebSocketConnection>&);
+    std::size_t broadcast(std::string message);
+    std::size_t size() const;
+    std::uint64_t dropped() const;
+};
+
+#endif //FLEET_WEBSOCKET_H
@@ -1,7 +1,76 @@
+#include <boost/tokenizer.hpp>
+
 #include "http_common.h"
 
 HTTPMessage::HTTPMessage()
 {
     this->isRequest = false;
+    this->type = RequestType::GET;
     this->status = boost::beast::http::status::ok;
-}
\ No newline at end of file
+}
+
+bool to_request_type(boost::beast::http::verb method, RequestType& type)
+{
+    if (method == boost::beast::http::verb::get)
+        type = RequestType::GET;
+    else if (method == boost::beast::http::verb::post)
+        type = RequestType::POST;
+    else if (method == boost::beast::http::verb::delete_)
+        type = RequestType::DELETE;
+    else if (method == boost::beast::http::verb::put)
+        type = RequestType::PUT;
+    else if (method == boost::beast::http::verb::head)
+        type = RequestType::HEAD;
+    else if (method == boost::beast::http::verb::options)
+        type = RequestType::OPTIONS;
+    else
+        return false;
+
+    return true;
+}
+
+// Splits a request target into its path and HTTPMessage::query parameters
+void parse_target(const std::string& target, std::string& target_path, HTTPMessage& message)
+{
+    target_path = target;
+    std::string query_string;
+    boost::escaped_list_separator<char> query_separator("", "?", "\"\'");
+    boost::escaped_list_separator<char> query_param_separator("", "&", "\"\'");
+    boost::escaped_list_separator<char> key_separator("", "=", "\"\'");
+    boost::tokenizer<boost::escaped_list_separator<char>> url_tokens(target, query_separator);
+
+    bool target_reset = true;
+
+    for(const auto& it : url_tokens)
+    {
+        if (target_reset) {
+            target_path = it;
+            target_reset = false;
+        }
+        else
+            query_string = it;
+    }
+
+    boost::tokenizer<boost::escaped_list_separator<char>> query_tokens(query_string, query_param_separator);
+    for(const auto& it: query_tokens)
+    {
+        // Here, we will get a key-value pair in each step. We can split that, and populate HTTPMessage::populate
+        bool isKey = true;
+        std::string key, value;
+        boost::tokenizer<boost::escaped_list_separator<char>> key_value(it, key_separator);
+        for(const auto& token : key_value)
+        {
+            if (isKey)
+            {
+                key = token;
+                isKey = false;
+            }
+            else
+            {
+                value = token;
+            }
+        }
+
+        message.query[key] = value;
+    }
+}
@@ -29,8 +29,12 @@ struct HTTPMessage
     std::unordered_map<std::string, std::string> header;
     std::unordered_map<std::string, std::string> query;
     std::string body;
+    std::string remote_address;
 
     HTTPMessage();
 };
 
+bool to_request_type(boost::beast::http::verb method, RequestType& type);
+void parse_target(const std::string& target, std::string& target_path, HTTPMessage& message);
+
 #endif //FLEET_HTTP_COMMON_H
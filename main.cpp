@@ -1,9 +1,12 @@
 #include <iostream>
+#include <memory>
+#include "./libhttpserver/RateLimiter.h"
 #include "./libhttpserver/RequestRouter.h"
 #include "./libhttpserver/WebServer.h"
 
 int main() {
     RequestRouter router;
+    router.rate_limit(std::make_shared<RateLimiter>(100, 200));
     router["/hello"].get([](const HTTPMessage& req) -> HTTPMessage
                          {
                             HTTPMessage response;
@@ -11,11 +14,24 @@ int main() {
                             response.status = boost::beast::http::status::ok;
                             return response;
                          });
+    auto updates = std::make_shared<WebSocketChannel>();
+    WebSocketHandler relay;
+    relay.on_open = [updates](const std::shared_ptr<WebSocketConnection>& connection)
+                    {
+                        updates->subscribe(connection);
+                    };
+    relay.on_message = [updates](const std::shared_ptr<WebSocketConnection>& connection, const std::string& message)
+                       {
+                           updates->broadcast(message);
+                       };
+    router["/updates"].websocket(relay);
+    router["/version"].get_static(boost::beast::http::status::ok, "1.0", {{"Content-Type", "text/plain"}});
     WebServer server(router, "localhost", 8888);
     server.setTlsCertificates("/tmp/ssl/localhost_certificate.crt",
                               "/tmp/ssl/localhost_private.key",
                               "/tmp/ssl/diffey_hellman.pem",
                               "private_key_password");
+    server.setAccessLog();
     server.run();
     return 0;
 }